@@ -7,13 +7,11 @@
 #include <string.h>
 #include <unistd.h>
 #include <dirent.h>
+#include <fcntl.h>
+#include <openssl/ssl.h>
 
-pthread_mutex_t user_mutex  = PTHREAD_MUTEX_INITIALIZER;
-pthread_mutex_t group_mutex = PTHREAD_MUTEX_INITIALIZER;
-int highest_user_id         = 0;
-int lowest_user_id          = 0;
-int highest_group_id        = 0;
-int lowest_group_id         = 0;
+static uint64_t user_id_range  = 0;
+static uint64_t group_id_range = 0;
 
 SET_GET_HIGH_LOW_ID(highest, user);
 SET_GET_HIGH_LOW_ID(lowest, user);
@@ -24,6 +22,8 @@ ID_QUERY_AVAILABLE(user, high, <)
 ID_QUERY_AVAILABLE(user, low, >)
 ID_QUERY_AVAILABLE(group, high, <)
 ID_QUERY_AVAILABLE(group, low, >)
+ID_RANGE_QUERY_AVAILABLE(user)
+ID_RANGE_QUERY_AVAILABLE(group)
 
 #define TRIM_SLASH(key)                                                                                                \
   if (c->key != NULL) {                                                                                                \
@@ -53,11 +53,52 @@ static void stns_force_create_cache_dir(stns_conf_t *c)
   }
 }
 
+// The ids and the name patterns of one kind under [reject].
+static void stns_load_reject(toml_table_t *tab, const char *ids_key, const char *names_key, stns_reject_t *r,
+                             char *filename)
+{
+  toml_array_t *list;
+  const char *raw;
+  char *spec;
+  int i, id;
+
+  if (0 != (list = toml_array_in(tab, ids_key))) {
+    for (i = 0; 0 != (raw = toml_raw_at(list, i)); i++) {
+      if (0 == toml_rtoi(raw, &id)) {
+        if (0 != stns_reject_add_range(r, id, id))
+          syslog(LOG_ERR, "%s(stns)[L%d] invalid reject id:%d", __func__, __LINE__, id);
+        continue;
+      }
+      if (0 != toml_rtos(raw, &spec)) {
+        syslog(LOG_ERR, "%s(stns)[L%d] cannot parse toml file:%s key:%s", __func__, __LINE__, filename, ids_key);
+        continue;
+      }
+      if (0 != stns_reject_add_ids(r, spec))
+        syslog(LOG_ERR, "%s(stns)[L%d] invalid reject ids:%s", __func__, __LINE__, spec);
+      free(spec);
+    }
+  }
+  if (0 != (list = toml_array_in(tab, names_key))) {
+    for (i = 0; 0 != (raw = toml_raw_at(list, i)); i++) {
+      if (0 != toml_rtos(raw, &spec)) {
+        syslog(LOG_ERR, "%s(stns)[L%d] cannot parse toml file:%s key:%s", __func__, __LINE__, filename, names_key);
+        continue;
+      }
+      if (0 != stns_reject_add_name(r, spec))
+        syslog(LOG_ERR, "%s(stns)[L%d] invalid reject name:%s", __func__, __LINE__, spec);
+      free(spec);
+    }
+  }
+  stns_reject_compile(r);
+}
+
 int stns_load_config(char *filename, stns_conf_t *c)
 {
   char errbuf[200];
   const char *raw, *key;
   toml_table_t *in_tab;
+  toml_array_t *trip_on;
+  int i;
 
 #ifdef DEBUG
   syslog(LOG_ERR, "%s(stns)[L%d] start load config", __func__, __LINE__);
@@ -87,23 +128,67 @@ int stns_load_config(char *filename, stns_conf_t *c)
   GET_TOML_BY_TABLE_KEY(tls, key, toml_rtos, NULL, TOML_NULL_OR_INT);
   GET_TOML_BY_TABLE_KEY(tls, cert, toml_rtos, NULL, TOML_NULL_OR_INT);
   GET_TOML_BY_TABLE_KEY(tls, ca, toml_rtos, NULL, TOML_NULL_OR_INT);
+  GET_TOML_BY_TABLE_KEY(tls, session_cache, toml_rtob, 0, TOML_NULL_OR_INT);
   GET_TOML_BY_TABLE_KEY(cached, enable, toml_rtob, 0, TOML_NULL_OR_INT);
   GET_TOML_BY_TABLE_KEY(cached, unix_socket, toml_rtos, "/var/run/cache-stnsd.sock", TOML_STR);
 
   GET_TOML_BYKEY(uid_shift, toml_rtoi, 0, TOML_NULL_OR_INT);
   GET_TOML_BYKEY(gid_shift, toml_rtoi, 0, TOML_NULL_OR_INT);
   GET_TOML_BYKEY(cache_ttl, toml_rtoi, 600, TOML_NULL_OR_INT);
+  GET_TOML_BYKEY(cache_stale_ttl, toml_rtoi, 0, TOML_NULL_OR_INT);
+  GET_TOML_BYKEY(cache_stale_while_revalidate, toml_rtob, 0, TOML_NULL_OR_INT);
   GET_TOML_BYKEY(negative_cache_ttl, toml_rtoi, 10, TOML_NULL_OR_INT);
+  GET_TOML_BYKEY(cache_slots, toml_rtoi, STNS_CACHE_SLOTS, TOML_NULL_OR_INT);
+  GET_TOML_BYKEY(cache_l1_entries, toml_rtoi, STNS_L1_ENTRIES, TOML_NULL_OR_INT);
+  GET_TOML_BYKEY(cache_snapshot_lookups, toml_rtob, 0, TOML_NULL_OR_INT);
+  GET_TOML_BYKEY(cache_name_filter, toml_rtob, 0, TOML_NULL_OR_INT);
   GET_TOML_BYKEY(ssl_verify, toml_rtob, 1, TOML_NULL_OR_INT);
   GET_TOML_BYKEY(cache, toml_rtob, 1, TOML_NULL_OR_INT);
   GET_TOML_BYKEY(request_timeout, toml_rtoi, 10, TOML_NULL_OR_INT);
   GET_TOML_BYKEY(request_retry, toml_rtoi, 3, TOML_NULL_OR_INT);
   GET_TOML_BYKEY(request_locktime, toml_rtoi, 60, TOML_NULL_OR_INT);
+  GET_TOML_BYKEY(request_deadline, toml_rtoi, 0, TOML_NULL_OR_INT);
+  GET_TOML_BYKEY(request_connect_timeout, toml_rtoi, 0, TOML_NULL_OR_INT);
+  GET_TOML_BYKEY(request_backoff, toml_rtoi, 100, TOML_NULL_OR_INT);
+  GET_TOML_BYKEY(request_backoff_max, toml_rtoi, 1000, TOML_NULL_OR_INT);
   GET_TOML_BYKEY(http_location, toml_rtob, 0, TOML_NULL_OR_INT);
+  GET_TOML_BY_TABLE_KEY(circuit_breaker, failures, toml_rtoi, 1, TOML_NULL_OR_INT);
+  GET_TOML_BY_TABLE_KEY(circuit_breaker, rate, toml_rtoi, 0, TOML_NULL_OR_INT);
+  GET_TOML_BY_TABLE_KEY(circuit_breaker, window, toml_rtoi, 60, TOML_NULL_OR_INT);
+
+  // only a refused connection locked lookups out before the breaker, so by
+  // default nothing else trips it
+  c->circuit_breaker_trip_on = STNS_BREAKER_TRIP_CONNECT;
+  if (0 != (in_tab = toml_table_in(tab, "circuit_breaker")) && 0 != (trip_on = toml_array_in(in_tab, "trip_on"))) {
+    c->circuit_breaker_trip_on = 0;
+    for (i = 0; 0 != (raw = toml_raw_at(trip_on, i)); i++) {
+      char *name;
+      int trip;
+      if (0 != toml_rtos(raw, &name)) {
+        syslog(LOG_ERR, "%s(stns)[L%d] cannot parse toml file:%s key:trip_on", __func__, __LINE__, filename);
+        continue;
+      }
+      if ((trip = stns_breaker_trip_class(name)) == 0)
+        syslog(LOG_ERR, "%s(stns)[L%d] unknown trip_on class: %s", __func__, __LINE__, name);
+      c->circuit_breaker_trip_on |= trip;
+      free(name);
+    }
+  }
+
+  memset(&c->reject_user, 0, sizeof(stns_reject_t));
+  memset(&c->reject_group, 0, sizeof(stns_reject_t));
+  if (0 != (in_tab = toml_table_in(tab, "reject"))) {
+    stns_load_reject(in_tab, "uid", "user", &c->reject_user, filename);
+    stns_load_reject(in_tab, "gid", "group", &c->reject_group, filename);
+  }
 
   TRIM_SLASH(api_endpoint)
   TRIM_SLASH(cache_dir)
 
+  // without a deadline all attempts together get what one attempt had
+  if (c->request_deadline <= 0)
+    c->request_deadline = c->request_timeout * 1000;
+
   int header_size                      = 0;
   stns_user_httpheader_t *http_headers = NULL;
 
@@ -172,6 +257,8 @@ void stns_unload_config(stns_conf_t *c)
   UNLOAD_TOML_BYKEY(tls_key);
   UNLOAD_TOML_BYKEY(tls_ca);
   UNLOAD_TOML_BYKEY(cached_unix_socket);
+  stns_reject_free(&c->reject_user);
+  stns_reject_free(&c->reject_group);
 
   if (c->http_headers != NULL) {
     int i = 0;
@@ -181,8 +268,8 @@ void stns_unload_config(stns_conf_t *c)
     for (i = 0; i < c->http_headers->size; i++) {
       free(c->http_headers->headers[i].value);
       free(c->http_headers->headers[i].key);
-      free(c->http_headers->headers);
     }
+    free(c->http_headers->headers);
 #ifdef DEBUG
     syslog(LOG_ERR, "%s(stns)[L%d] after free", __func__, __LINE__);
 #endif
@@ -190,6 +277,108 @@ void stns_unload_config(stns_conf_t *c)
   UNLOAD_TOML_BYKEY(http_headers);
 }
 
+// The parsed configuration is shared by every thread of the process and only
+// rebuilt when stns.conf is replaced or modified.
+typedef struct stns_conf_snapshot_t stns_conf_snapshot_t;
+struct stns_conf_snapshot_t {
+  stns_conf_t conf;
+  int refcount;
+  char *filename;
+  dev_t dev;
+  ino_t ino;
+  off_t size;
+  struct timespec mtime;
+};
+
+static pthread_mutex_t config_mutex          = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t config_once            = PTHREAD_ONCE_INIT;
+static stns_conf_snapshot_t *current_config = NULL;
+
+static void config_atfork_prepare(void)
+{
+  pthread_mutex_lock(&config_mutex);
+}
+
+static void config_atfork_release(void)
+{
+  pthread_mutex_unlock(&config_mutex);
+}
+
+static void config_init(void)
+{
+  pthread_atfork(config_atfork_prepare, config_atfork_release, config_atfork_release);
+}
+
+static int config_is_fresh(stns_conf_snapshot_t *s, char *filename, struct stat *st)
+{
+  return s != NULL && strcmp(s->filename, filename) == 0 && s->dev == st->st_dev && s->ino == st->st_ino &&
+         s->size == st->st_size && s->mtime.tv_sec == st->st_mtim.tv_sec && s->mtime.tv_nsec == st->st_mtim.tv_nsec;
+}
+
+static void config_unref(stns_conf_snapshot_t *s)
+{
+  if (--s->refcount > 0)
+    return;
+  stns_unload_config(&s->conf);
+  free(s->filename);
+  free(s);
+}
+
+stns_conf_t *stns_acquire_config(char *filename)
+{
+  struct stat st;
+  stns_conf_snapshot_t *s;
+
+  pthread_once(&config_once, config_init);
+  if (stat(filename, &st) != 0) {
+    syslog(LOG_ERR, "%s(stns)[L%d] cannot stat %s: %s", __func__, __LINE__, filename, strerror(errno));
+    return NULL;
+  }
+
+  pthread_mutex_lock(&config_mutex);
+  if (config_is_fresh(current_config, filename, &st)) {
+    s = current_config;
+    s->refcount++;
+    pthread_mutex_unlock(&config_mutex);
+    return &s->conf;
+  }
+  pthread_mutex_unlock(&config_mutex);
+
+  s = (stns_conf_snapshot_t *)calloc(1, sizeof(stns_conf_snapshot_t));
+  if (s == NULL)
+    return NULL;
+
+  if (stns_load_config(filename, &s->conf) != 0) {
+    free(s);
+    return NULL;
+  }
+  s->filename = strdup(filename);
+  s->dev      = st.st_dev;
+  s->ino      = st.st_ino;
+  s->size     = st.st_size;
+  s->mtime    = st.st_mtim;
+  // one reference is held by current_config and one by the caller
+  s->refcount = 2;
+
+  pthread_mutex_lock(&config_mutex);
+  if (current_config != NULL)
+    config_unref(current_config);
+  current_config = s;
+  pthread_mutex_unlock(&config_mutex);
+  // records kept in the process may not hold under the new configuration
+  stns_l1_reset(s->conf.cache && !s->conf.cached_enable ? s->conf.cache_l1_entries : 0);
+  return &s->conf;
+}
+
+void stns_release_config(stns_conf_t *c)
+{
+  if (c == NULL)
+    return;
+  pthread_mutex_lock(&config_mutex);
+  config_unref((stns_conf_snapshot_t *)c);
+  pthread_mutex_unlock(&config_mutex);
+}
+
 static void trim(char *s)
 {
   int i, j;
@@ -208,16 +397,18 @@ static void trim(char *s)
 }
 
 #define SET_TRIM_ID(high_or_low, user_or_group, short_name)                                                            \
-  tp = strtok(NULL, ".");                                                                                              \
+  tp = strtok_r(NULL, ".", &saveptr);                                                                                  \
   trim(tp);                                                                                                            \
-  set_##user_or_group##_##high_or_low##est_id(atoi(tp) + c->short_name##id_shift);
+  set_##user_or_group##_##high_or_low##est_id(atoi(tp) + c->short_name##id_shift);                                     \
+  stns_state_put_id_range(c, STNS_ID_RANGE_##user_or_group,                                                            \
+                          __atomic_load_n(&user_or_group##_id_range, __ATOMIC_ACQUIRE));
 
 static size_t header_callback(char *buffer, size_t size, size_t nitems, void *userdata)
 {
 
   stns_conf_t *c = (stns_conf_t *)userdata;
-  char *tp;
-  tp = strtok(buffer, ":");
+  char *tp, *saveptr;
+  tp = strtok_r(buffer, ":", &saveptr);
   if (strcmp(tp, "User-Highest-Id") == 0) {
     SET_TRIM_ID(high, user, u)
   } else if (strcmp(tp, "User-Lowest-Id") == 0) {
@@ -253,8 +444,316 @@ static size_t response_callback(void *buffer, size_t size, size_t nmemb, void *u
   return segsize;
 }
 
+// Each thread keeps its own easy handle so that the connection cache, and with it
+// keep-alive connections and TLS sessions, survives between lookups.
+typedef struct stns_http_handle_t stns_http_handle_t;
+struct stns_http_handle_t {
+  CURL *curl;
+  pid_t pid;
+};
+
+// All threads share one DNS cache and one TLS session cache, so only the first
+// connection of the process pays for a full handshake. Connections themselves
+// stay per thread: libcurl does not support sharing them between concurrent threads.
+typedef struct stns_http_share_t stns_http_share_t;
+struct stns_http_share_t {
+  CURLSH *share;
+  pid_t pid;
+  pthread_mutex_t locks[CURL_LOCK_DATA_LAST];
+};
+
+static pthread_key_t http_handle_key;
+static pthread_once_t http_handle_once       = PTHREAD_ONCE_INIT;
+static pthread_mutex_t http_share_mutex      = PTHREAD_MUTEX_INITIALIZER;
+static stns_http_share_t *http_share         = NULL;
+static unsigned long http_new_connections    = 0;
+static unsigned long http_reused_connections = 0;
+
+static void http_share_lock(CURL *curl, curl_lock_data data, curl_lock_access access, void *userptr)
+{
+  stns_http_share_t *s = (stns_http_share_t *)userptr;
+  pthread_mutex_lock(&s->locks[data]);
+}
+
+static void http_share_unlock(CURL *curl, curl_lock_data data, void *userptr)
+{
+  stns_http_share_t *s = (stns_http_share_t *)userptr;
+  pthread_mutex_unlock(&s->locks[data]);
+}
+
+static void http_share_atfork_prepare(void)
+{
+  pthread_mutex_lock(&http_share_mutex);
+}
+
+static void http_share_atfork_release(void)
+{
+  pthread_mutex_unlock(&http_share_mutex);
+}
+
+static CURLSH *stns_http_share(void)
+{
+  int i;
+  stns_http_share_t *s;
+
+  pthread_mutex_lock(&http_share_mutex);
+  // A share inherited through fork() may be locked by a thread that no longer
+  // exists and caches the parent's TLS state, so the child builds its own.
+  if (http_share != NULL && http_share->pid == getpid()) {
+    pthread_mutex_unlock(&http_share_mutex);
+    return http_share->share;
+  }
+
+  s = (stns_http_share_t *)malloc(sizeof(stns_http_share_t));
+  if (s == NULL || (s->share = curl_share_init()) == NULL) {
+    free(s);
+    pthread_mutex_unlock(&http_share_mutex);
+    return NULL;
+  }
+  s->pid = getpid();
+  for (i = 0; i < CURL_LOCK_DATA_LAST; i++) {
+    pthread_mutex_init(&s->locks[i], NULL);
+  }
+  curl_share_setopt(s->share, CURLSHOPT_LOCKFUNC, http_share_lock);
+  curl_share_setopt(s->share, CURLSHOPT_UNLOCKFUNC, http_share_unlock);
+  curl_share_setopt(s->share, CURLSHOPT_USERDATA, s);
+  curl_share_setopt(s->share, CURLSHOPT_SHARE, CURL_LOCK_DATA_DNS);
+  curl_share_setopt(s->share, CURLSHOPT_SHARE, CURL_LOCK_DATA_SSL_SESSION);
+  http_share = s;
+  pthread_mutex_unlock(&http_share_mutex);
+  return s->share;
+}
+
+static void http_count_connection(CURL *curl)
+{
+  long connects = 0;
+  if (curl_easy_getinfo(curl, CURLINFO_NUM_CONNECTS, &connects) != CURLE_OK)
+    return;
+  if (connects > 0)
+    __atomic_add_fetch(&http_new_connections, 1, __ATOMIC_RELAXED);
+  else
+    __atomic_add_fetch(&http_reused_connections, 1, __ATOMIC_RELAXED);
+}
+
+// TLS sessions are persisted under cache_dir so that short-lived processes can
+// resume the session of an earlier one instead of doing a full handshake.
+// The file holds STNS_TLS_SESSION_MAGIC, the NUL terminated api_endpoint the
+// session belongs to and the DER encoded SSL_SESSION.
+static pthread_mutex_t tls_session_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t tls_session_once   = PTHREAD_ONCE_INIT;
+static SSL_SESSION *tls_session          = NULL;
+static char *tls_session_endpoint        = NULL;
+static int tls_session_path_idx          = -1;
+
+static int (*tls_next_new_session_cb)(SSL *, SSL_SESSION *) = NULL;
+
+static void tls_session_path_free(void *parent, void *ptr, CRYPTO_EX_DATA *ad, int idx, long argl, void *argp)
+{
+  free(ptr);
+}
+
+static void tls_session_init(void)
+{
+  tls_session_path_idx = SSL_CTX_get_ex_new_index(0, NULL, NULL, NULL, tls_session_path_free);
+}
+
+static void tls_session_path(stns_conf_t *c, char *path, size_t len)
+{
+  snprintf(path, len, "%s/%d/%s", c->cache_dir, geteuid(), STNS_TLS_SESSION_FILE);
+}
+
+// Must be called with tls_session_mutex held.
+static void tls_session_load(stns_conf_t *c)
+{
+  char path[MAXBUF * 2];
+  struct stat st;
+  char *data = NULL;
+  const unsigned char *der;
+  size_t header_len;
+  SSL_SESSION *sess;
+  int fd;
+
+  if (tls_session_endpoint != NULL && strcmp(tls_session_endpoint, c->api_endpoint) == 0)
+    return;
+
+  if (tls_session != NULL)
+    SSL_SESSION_free(tls_session);
+  free(tls_session_endpoint);
+  tls_session          = NULL;
+  tls_session_endpoint = strdup(c->api_endpoint);
+
+  tls_session_path(c, path, sizeof(path));
+  if ((fd = open(path, O_RDONLY | O_NOFOLLOW | O_CLOEXEC)) < 0)
+    return;
+
+  // never resume a session another user could have planted
+  if (fstat(fd, &st) != 0 || st.st_uid != geteuid() || (st.st_mode & (S_IWGRP | S_IWOTH)) ||
+      st.st_size > STNS_TLS_SESSION_MAX_SIZE)
+    goto out;
+
+  header_len = strlen(STNS_TLS_SESSION_MAGIC) + strlen(c->api_endpoint) + 1;
+  data       = (char *)malloc(st.st_size);
+  if (data == NULL || read(fd, data, st.st_size) != st.st_size || (size_t)st.st_size <= header_len)
+    goto out;
+  if (memcmp(data, STNS_TLS_SESSION_MAGIC, strlen(STNS_TLS_SESSION_MAGIC)) != 0 ||
+      strcmp(data + strlen(STNS_TLS_SESSION_MAGIC), c->api_endpoint) != 0)
+    goto out;
+
+  der  = (const unsigned char *)data + header_len;
+  sess = d2i_SSL_SESSION(NULL, &der, st.st_size - header_len);
+  if (sess == NULL)
+    goto out;
+  if (SSL_SESSION_get_time(sess) + SSL_SESSION_get_timeout(sess) < time(NULL)) {
+    SSL_SESSION_free(sess);
+    goto out;
+  }
+  tls_session = sess;
+out:
+  free(data);
+  close(fd);
+}
+
+static void tls_session_save(const char *path, SSL_SESSION *sess)
+{
+  char tmp[MAXBUF * 2 + 8];
+  unsigned char *der = NULL;
+  int der_len;
+  int fd;
+  int ok;
+
+  if ((der_len = i2d_SSL_SESSION(sess, &der)) <= 0)
+    return;
+
+  snprintf(tmp, sizeof(tmp), "%s.XXXXXX", path);
+  // mkstemp creates the file with mode 0600
+  if ((fd = mkstemp(tmp)) < 0) {
+    OPENSSL_free(der);
+    return;
+  }
+  ok = write(fd, STNS_TLS_SESSION_MAGIC, strlen(STNS_TLS_SESSION_MAGIC)) == strlen(STNS_TLS_SESSION_MAGIC) &&
+       write(fd, tls_session_endpoint, strlen(tls_session_endpoint) + 1) == strlen(tls_session_endpoint) + 1 &&
+       write(fd, der, der_len) == der_len;
+  close(fd);
+  OPENSSL_free(der);
+
+  if (!ok || rename(tmp, path) != 0)
+    unlink(tmp);
+}
+
+static int tls_new_session_cb(SSL *ssl, SSL_SESSION *sess)
+{
+  const char *path = SSL_CTX_get_ex_data(SSL_get_SSL_CTX(ssl), tls_session_path_idx);
+
+  pthread_mutex_lock(&tls_session_mutex);
+  if (path != NULL && tls_session_endpoint != NULL) {
+    if (tls_session != NULL)
+      SSL_SESSION_free(tls_session);
+    SSL_SESSION_up_ref(sess);
+    tls_session = sess;
+    tls_session_save(path, sess);
+  }
+  pthread_mutex_unlock(&tls_session_mutex);
+
+  // libcurl keeps its in-memory session cache through the same callback
+  if (tls_next_new_session_cb != NULL)
+    return tls_next_new_session_cb(ssl, sess);
+  return 0;
+}
+
+static void tls_info_cb(const SSL *ssl, int where, int ret)
+{
+  // libcurl already set a session when it found one in its own cache
+  if (where != SSL_CB_HANDSHAKE_START || SSL_get_session(ssl) != NULL)
+    return;
+
+  pthread_mutex_lock(&tls_session_mutex);
+  if (tls_session != NULL)
+    SSL_set_session((SSL *)ssl, tls_session);
+  pthread_mutex_unlock(&tls_session_mutex);
+}
+
+static CURLcode tls_ssl_ctx_function(CURL *curl, void *ssl_ctx, void *userptr)
+{
+  stns_conf_t *c = (stns_conf_t *)userptr;
+  SSL_CTX *ctx   = (SSL_CTX *)ssl_ctx;
+  char path[MAXBUF * 2];
+  int (*cb)(SSL *, SSL_SESSION *);
+
+  pthread_once(&tls_session_once, tls_session_init);
+  tls_session_path(c, path, sizeof(path));
+  SSL_CTX_set_ex_data(ctx, tls_session_path_idx, strdup(path));
+
+  pthread_mutex_lock(&tls_session_mutex);
+  tls_session_load(c);
+  cb = SSL_CTX_sess_get_new_cb(ctx);
+  if (cb != NULL && cb != tls_new_session_cb)
+    tls_next_new_session_cb = cb;
+  pthread_mutex_unlock(&tls_session_mutex);
+
+  SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_CLIENT | SSL_SESS_CACHE_NO_INTERNAL);
+  SSL_CTX_sess_set_new_cb(ctx, tls_new_session_cb);
+  SSL_CTX_set_info_callback(ctx, tls_info_cb);
+  return CURLE_OK;
+}
+
+void stns_http_connection_stats(unsigned long *new_connections, unsigned long *reused_connections)
+{
+  *new_connections    = __atomic_load_n(&http_new_connections, __ATOMIC_RELAXED);
+  *reused_connections = __atomic_load_n(&http_reused_connections, __ATOMIC_RELAXED);
+}
+
+static void http_handle_free(void *p)
+{
+  stns_http_handle_t *h = (stns_http_handle_t *)p;
+  if (h->pid == getpid())
+    curl_easy_cleanup(h->curl);
+  free(h);
+}
+
+static void http_handle_init(void)
+{
+  pthread_key_create(&http_handle_key, http_handle_free);
+  pthread_atfork(http_share_atfork_prepare, http_share_atfork_release, http_share_atfork_release);
+}
+
+static CURL *stns_http_handle(void)
+{
+  stns_http_handle_t *h;
+  CURLSH *share;
+
+  pthread_once(&http_handle_once, http_handle_init);
+  h = (stns_http_handle_t *)pthread_getspecific(http_handle_key);
+
+  // A handle inherited through fork() shares its sockets with the parent.
+  // Abandon it without cleanup so the parent's connections are left untouched.
+  if (h != NULL && h->pid != getpid()) {
+    free(h);
+    h = NULL;
+    pthread_setspecific(http_handle_key, NULL);
+  }
+
+  if (h != NULL) {
+    curl_easy_reset(h->curl);
+  } else {
+    h = (stns_http_handle_t *)malloc(sizeof(stns_http_handle_t));
+    if (h == NULL)
+      return NULL;
+    h->curl = curl_easy_init();
+    h->pid  = getpid();
+    if (h->curl == NULL) {
+      free(h);
+      return NULL;
+    }
+    pthread_setspecific(http_handle_key, h);
+  }
+
+  if ((share = stns_http_share()) != NULL)
+    curl_easy_setopt(h->curl, CURLOPT_SHARE, share);
+  return h->curl;
+}
+
 // base https://github.com/linyows/octopass/blob/master/octopass.c
-static CURLcode inner_http_request(stns_conf_t *c, char *path, stns_response_t *res)
+static CURLcode inner_http_request(stns_conf_t *c, char *path, stns_response_t *res, long timeout_ms)
 {
   char *auth       = NULL;
   char *in_headers = NULL;
@@ -266,10 +765,16 @@ static CURLcode inner_http_request(stns_conf_t *c, char *path, stns_response_t *
 #ifdef DEBUG
   syslog(LOG_ERR, "%s(stns)[L%d] send http request: %s", __func__, __LINE__, url);
 #endif
-  curl = curl_easy_init();
+  curl = stns_http_handle();
 #ifdef DEBUG
   syslog(LOG_ERR, "%s(stns)[L%d] init http request: %s", __func__, __LINE__, url);
 #endif
+  if (curl == NULL) {
+    res->data        = NULL;
+    res->size        = 0;
+    res->status_code = 0;
+    return CURLE_FAILED_INIT;
+  }
 
   if (!c->cached_enable) {
     if (c->auth_token != NULL) {
@@ -319,6 +824,14 @@ static CURLcode inner_http_request(stns_conf_t *c, char *path, stns_response_t *
       curl_easy_setopt(curl, CURLOPT_CAINFO, c->tls_ca);
     }
 
+    if (c->tls_session_cache) {
+      char dir[MAXBUF];
+      snprintf(dir, sizeof(dir), "%s/%d", c->cache_dir, geteuid());
+      mkdir(dir, S_IRWXU);
+      curl_easy_setopt(curl, CURLOPT_SSL_CTX_FUNCTION, tls_ssl_ctx_function);
+      curl_easy_setopt(curl, CURLOPT_SSL_CTX_DATA, c);
+    }
+
     if (c->user != NULL) {
       curl_easy_setopt(curl, CURLOPT_USERNAME, c->user);
     }
@@ -337,12 +850,16 @@ static CURLcode inner_http_request(stns_conf_t *c, char *path, stns_response_t *
   }
   curl_easy_setopt(curl, CURLOPT_URL, url);
   curl_easy_setopt(curl, CURLOPT_NOPROGRESS, 1);
-  curl_easy_setopt(curl, CURLOPT_TIMEOUT, c->request_timeout);
+  curl_easy_setopt(curl, CURLOPT_TIMEOUT_MS, timeout_ms);
+  // curl lets the total timeout win when it is the shorter one
+  if (c->request_connect_timeout > 0)
+    curl_easy_setopt(curl, CURLOPT_CONNECTTIMEOUT_MS, (long)c->request_connect_timeout);
   curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, response_callback);
   curl_easy_setopt(curl, CURLOPT_HEADERFUNCTION, header_callback);
   curl_easy_setopt(curl, CURLOPT_WRITEDATA, res);
   curl_easy_setopt(curl, CURLOPT_HEADERDATA, c);
   curl_easy_setopt(curl, CURLOPT_NOSIGNAL, 1);
+  curl_easy_setopt(curl, CURLOPT_TCP_KEEPALIVE, 1L);
 
 #ifdef DEBUG
   syslog(LOG_ERR, "%s(stns)[L%d] before request http request: %s", __func__, __LINE__, url);
@@ -352,6 +869,7 @@ static CURLcode inner_http_request(stns_conf_t *c, char *path, stns_response_t *
   syslog(LOG_ERR, "%s(stns)[L%d] after request http request: %s", __func__, __LINE__, url);
 #endif
 
+  http_count_connection(curl);
   long code;
   curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &code);
 #ifdef DEBUG
@@ -382,36 +900,68 @@ static CURLcode inner_http_request(stns_conf_t *c, char *path, stns_response_t *
   }
 
   free(url);
-  curl_easy_cleanup(curl);
 #ifdef DEBUG
   syslog(LOG_ERR, "%s(stns)[L%d] after free", __func__, __LINE__);
 #endif
   return result;
 }
 
-int stns_request_available(char *path, stns_conf_t *c)
+static int cache_file_write_all(int fd, const char *p, size_t len)
 {
-  struct stat st;
-  if (stat(path, &st) != 0) {
-    return 1;
-  }
+  ssize_t n;
 
-  unsigned long now  = time(NULL);
-  unsigned long diff = now - st.st_ctime;
-  if (diff > c->request_locktime) {
-    remove(path);
-    return 1;
+  while (len > 0) {
+    if ((n = write(fd, p, len)) < 0) {
+      if (errno == EINTR)
+        continue;
+      return 0;
+    }
+    p += n;
+    len -= n;
   }
-  return 0;
+  return 1;
 }
 
-void stns_make_lockfile(char *path)
+// Replace file with header followed by data, either of which may be NULL.
+// Both are written to a temporary file next to it that is renamed over it,
+// so a reader opens either the old file or the new one, complete, and never
+// one that is still being written. mtime, unless it is 0, becomes the
+// modification time. A temporary file left behind by a crash is not a dot
+// file and is collected by the GC like any other.
+int stns_cache_file_replace(const char *file, const char *header, size_t header_len, const char *data, size_t size,
+                            time_t mtime)
 {
-  FILE *fp;
-  fp = fopen(path, "w");
-  if (fp) {
-    fclose(fp);
+  char tmp[MAXBUF * 2 + 8];
+  struct timespec times[2];
+  int fd;
+
+  snprintf(tmp, sizeof(tmp), "%s.XXXXXX", file);
+  if ((fd = mkstemp(tmp)) < 0) {
+    syslog(LOG_ERR, "%s(stns)[L%d] cannot create %s: %s", __func__, __LINE__, tmp, strerror(errno));
+    return 0;
+  }
+  if ((header != NULL && !cache_file_write_all(fd, header, header_len)) ||
+      (data != NULL && !cache_file_write_all(fd, data, size))) {
+    syslog(LOG_ERR, "%s(stns)[L%d] cannot write %s: %s", __func__, __LINE__, tmp, strerror(errno));
+    close(fd);
+    unlink(tmp);
+    return 0;
+  }
+  fchmod(fd, S_IRUSR | S_IWUSR | S_IXUSR | S_IRGRP | S_IROTH);
+  if (mtime != 0) {
+    times[0].tv_sec  = mtime;
+    times[0].tv_nsec = 0;
+    times[1]         = times[0];
+    futimens(fd, times);
+  }
+  close(fd);
+
+  if (rename(tmp, file) != 0) {
+    syslog(LOG_ERR, "%s(stns)[L%d] cannot rename %s: %s", __func__, __LINE__, tmp, strerror(errno));
+    unlink(tmp);
+    return 0;
   }
+  return 1;
 }
 
 // base: https://github.com/linyows/octopass/blob/master/octopass.c
@@ -429,169 +979,518 @@ void stns_export_file(char *dir, char *file, char *data)
     return;
   }
 
-  FILE *fp = fopen(file, "w");
-  if (!fp) {
+  stns_cache_file_replace(file, NULL, 0, data, data != NULL ? strlen(data) : 0, 0);
+}
+
+// Read the whole of file into res with one fstat, one allocation and one read
+// of exactly its size, which is stored in res->size.
+// base: https://github.com/linyows/octopass/blob/master/octopass.c
+int stns_import_file(char *file, stns_response_t *res)
+{
+  struct stat statbuf;
+  ssize_t n;
+  char *data;
+  int fd = open(file, O_RDONLY | O_CLOEXEC);
+
+  if (fd < 0) {
     syslog(LOG_ERR, "%s(stns)[L%d] cannot open %s", __func__, __LINE__, file);
+    return 0;
+  }
+  if (fstat(fd, &statbuf) != 0 || (data = (char *)malloc(statbuf.st_size + 1)) == NULL) {
+    close(fd);
+    return 0;
+  }
+  n = read(fd, data, statbuf.st_size);
+  close(fd);
+  if (n != statbuf.st_size) {
+    free(data);
+    return 0;
+  }
+
+  data[n] = '\0';
+  free(res->data);
+  res->data = data;
+  res->size = n;
+  return 1;
+}
+
+// Responses too large for a cache slot are kept one file per query, named
+// after a 64-bit hash of the query and sharded by its first byte:
+// cache_dir/<euid>/<2 hex digits>/<16 hex digits>. A file starts with the
+// query and a newline, so that a hash collision reads as a miss, and the
+// body follows; a file holding only the query is a negative entry.
+static void cache_file_path(stns_conf_t *c, const char *query, char *dir, size_t dirlen, char *file,
+                            size_t filelen)
+{
+  uint64_t h = stns_hash64(query, strlen(query));
+  snprintf(dir, dirlen, "%s/%d/%02x", c->cache_dir, geteuid(), (unsigned int)(h >> 56));
+  snprintf(file, filelen, "%s/%016llx", dir, (unsigned long long)h);
+}
+
+// Store data for query, with mtime as its modification time unless it is 0.
+static void cache_file_write(stns_conf_t *c, const char *query, const char *data, size_t size, time_t mtime)
+{
+  char root[MAXBUF], dir[MAXBUF], file[MAXBUF];
+  char header[MAXBUF * 2];
+  struct stat statbuf;
+  mode_t um;
+  int header_len;
+
+  cache_file_path(c, query, dir, sizeof(dir), file, sizeof(file));
+  if (stat(dir, &statbuf) != 0) {
+    snprintf(root, sizeof(root), "%s/%d", c->cache_dir, geteuid());
+    um = umask(0);
+    mkdir(root, S_IRUSR | S_IWUSR | S_IXUSR);
+    mkdir(dir, S_IRUSR | S_IWUSR | S_IXUSR);
+    umask(um);
+  }
+
+  if (stat(file, &statbuf) == 0 && statbuf.st_uid != geteuid()) {
     return;
   }
-  if (data != NULL) {
-    fprintf(fp, "%s", data);
+
+  if ((header_len = snprintf(header, sizeof(header), "%s\n", query)) >= (int)sizeof(header))
+    return;
+  stns_cache_file_replace(file, header, header_len, data, size, mtime);
+}
+
+void stns_cache_file_put(stns_conf_t *c, const char *query, stns_response_t *res)
+{
+  cache_file_write(c, query, res->data, res->data != NULL ? res->size : 0, 0);
+}
+
+// Returns 1 when a file is cached for query, with its body in res, a size of
+// 0 and STNS_HTTP_NOTFOUND for a negative entry, and its mtime in stored_at.
+int stns_cache_file_get(stns_conf_t *c, const char *query, stns_response_t *res, time_t *stored_at)
+{
+  char dir[MAXBUF], file[MAXBUF];
+  struct stat statbuf;
+  size_t header = strlen(query) + 1;
+  ssize_t n;
+  char *data;
+  int fd;
+
+  cache_file_path(c, query, dir, sizeof(dir), file, sizeof(file));
+  if ((fd = open(file, O_RDONLY | O_CLOEXEC)) < 0)
+    return 0;
+  if (fstat(fd, &statbuf) != 0 || statbuf.st_uid != geteuid() || (size_t)statbuf.st_size < header ||
+      (data = (char *)malloc(statbuf.st_size + 1)) == NULL) {
+    close(fd);
+    return 0;
+  }
+  n = read(fd, data, statbuf.st_size);
+  close(fd);
+  if (n != statbuf.st_size || memcmp(data, query, header - 1) != 0 || data[header - 1] != '\n') {
+    free(data);
+    return 0;
   }
-  fclose(fp);
 
-  mode_t um = {0};
-  um        = umask(0);
-  chmod(file, S_IRUSR | S_IWUSR | S_IXUSR | S_IRGRP | S_IROTH);
-  umask(um);
+  memmove(data, data + header, n - header);
+  data[n - header] = '\0';
+  free(res->data);
+  res->data        = data;
+  res->size        = n - header;
+  res->status_code = res->size == 0 ? STNS_HTTP_NOTFOUND : 200;
+  *stored_at       = statbuf.st_mtime;
+  return 1;
 }
 
-// base: https://github.com/linyows/octopass/blob/master/octopass.c
-int stns_import_file(char *file, stns_response_t *res)
+// The body cached for path while it is still within cache_ttl, NULL when
+// there is none. *expires_at is when it stops being fresh. The file is
+// looked at before it is read, as an enumeration can be megabytes long.
+char *stns_cached_body(stns_conf_t *c, char *path, time_t *expires_at)
 {
-  FILE *fp = fopen(file, "r");
-  if (!fp) {
-    syslog(LOG_ERR, "%s(stns)[L%d] cannot open %s", __func__, __LINE__, file);
+  stns_response_t res = {NULL, 0, 0, 0};
+  char dir[MAXBUF], file[MAXBUF];
+  struct stat statbuf;
+  time_t stored_at;
+
+  if (!c->cache || c->cached_enable)
+    return NULL;
+  if (stns_cache_get(c, path, &res, expires_at)) {
+    if (*expires_at > time(NULL) && res.size > 0)
+      return res.data;
+    free(res.data);
+    res.data = NULL;
+  }
+
+  cache_file_path(c, path, dir, sizeof(dir), file, sizeof(file));
+  if (stat(file, &statbuf) != 0 || statbuf.st_mtime + c->cache_ttl <= time(NULL))
+    return NULL;
+  if (!stns_cache_file_get(c, path, &res, &stored_at) || res.size == 0) {
+    free(res.data);
+    return NULL;
+  }
+  *expires_at = stored_at + c->cache_ttl;
+  return res.data;
+}
+
+// Returns 1 when url looks a name up ("users?name=..." or "groups?name=...")
+// that the filter of names says does not exist. A filter that is missing or
+// older than cache_ttl is rebuilt by one process at a time from the
+// enumeration when it is cached, and is never fetched for the sake of one
+// name: without it the lookup goes on as usual, and set*ent builds the filter
+// from the next enumeration. A failed rebuild keeps its lease, so the next
+// attempt waits for it to run out.
+int stns_filter_absent(stns_conf_t *c, char *url)
+{
+  char query[16], key[32];
+  char *q = strchr(url, '?');
+  time_t expires_at;
+  int64_t lease;
+  char *data;
+  int ret;
+
+  if (q == NULL || strncmp(q, "?name=", 6) != 0 || (size_t)(q - url) >= sizeof(query))
+    return 0;
+  snprintf(query, sizeof(query), "%.*s", (int)(q - url), url);
+  if ((ret = stns_filter_get(c, query, q + 6)) >= 0)
+    return ret == 0;
+
+  snprintf(key, sizeof(key), "%s%s", STNS_FILTER_FILE, query);
+  if (!stns_state_claim_refresh(c, key, &lease))
     return 0;
+  if ((data = stns_cached_body(c, query, &expires_at)) == NULL)
+    return 0;
+  if (stns_filter_put(c, query, data, expires_at - c->cache_ttl))
+    stns_state_release_refresh(c, key, lease);
+  free(data);
+  return 0;
+}
+
+// A file of the flat layout that came before, cache_dir/<euid>/<escaped
+// query>, that can still be read is moved into the sharded layout by the GC,
+// keeping its age, so that no lookup looks for the flat layout or pays for
+// moving it.
+static void cache_file_migrate(stns_conf_t *c, const char *name, const char *legacy, struct stat *st)
+{
+  stns_response_t r;
+  char *query;
+
+  if ((query = curl_easy_unescape(NULL, name, 0, NULL)) == NULL)
+    return;
+  r.data = NULL;
+  r.size = 0;
+  if (st->st_size == 0 || stns_import_file((char *)legacy, &r)) {
+    cache_file_write(c, query, r.data, r.size, st->st_mtime);
+    unlink(legacy);
   }
+  free(r.data);
+  curl_free(query);
+}
 
-  char buf[MAXBUF];
-  int total_len = 0;
-  int len       = 0;
+// Expired query files are collected a batch at a time: every call examines
+// at most STNS_CACHE_GC_BATCH entries, continuing where the previous one left
+// off, shard after shard and then the top directory, where the files of the
+// flat layout are moved into the sharded one, and only one process of the
+// euid runs a batch per STNS_CACHE_GC_INTERVAL, so no lookup pays for the size
+// of the cache.
+static pthread_mutex_t gc_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t gc_once   = PTHREAD_ONCE_INIT;
+static DIR *gc_dir              = NULL;
+static int gc_shard             = 0;
+static char gc_root[MAXBUF];
+
+static void gc_atfork_prepare(void)
+{
+  pthread_mutex_lock(&gc_mutex);
+}
 
-  while (fgets(buf, sizeof(buf), fp) != NULL) {
-    len = strlen(buf);
-    if (!res->data) {
-      res->data = (char *)malloc(len + 1);
-    } else {
-      res->data = (char *)realloc(res->data, total_len + len + 1);
-    }
-    strcpy(res->data + total_len, buf);
-    total_len += len;
+static void gc_atfork_parent(void)
+{
+  pthread_mutex_unlock(&gc_mutex);
+}
+
+// the child would share the directory offset with the parent
+static void gc_atfork_child(void)
+{
+  if (gc_dir != NULL) {
+    closedir(gc_dir);
+    gc_dir = NULL;
   }
-  fclose(fp);
+  pthread_mutex_unlock(&gc_mutex);
+}
 
-  return 1;
+static void gc_init(void)
+{
+  pthread_atfork(gc_atfork_prepare, gc_atfork_parent, gc_atfork_child);
+}
+
+// Whether file is past every window it could still be read in. A sharded
+// file cannot tell a negative entry by its size, so it is kept for the longer
+// of the two.
+static int gc_expired(stns_conf_t *c, struct stat *st, int sharded, unsigned long now)
+{
+  unsigned long diff     = now - st->st_mtime;
+  unsigned long positive = c->cache_ttl + c->cache_stale_ttl;
+  unsigned long negative = c->negative_cache_ttl;
+
+  if (!S_ISREG(st->st_mode))
+    return 0;
+  if (sharded)
+    return diff > (positive > negative ? positive : negative);
+  return st->st_size > 0 ? diff > positive : diff > negative;
+}
+
+// Whether name is a file that mkstemp created as "<file>.XXXXXX" beside a
+// query file or one of the dot files, to be renamed over it; one that is
+// still there after STNS_CACHE_TEMP_TTL was left by a writer that died.
+static int gc_temp_file(const char *name, int sharded)
+{
+  static const char *stems[] = {STNS_CACHE_FILE, STNS_STATE_FILE, STNS_TLS_SESSION_FILE};
+  size_t len = strlen(name), stem, i;
+
+  if (len < 8 || name[len - 7] != '.')
+    return 0;
+  stem = len - 7;
+  if (sharded)
+    return name[0] != '.' && stem == 16;
+  for (i = 0; i < sizeof(stems) / sizeof(stems[0]); i++)
+    if (stem == strlen(stems[i]) && strncmp(name, stems[i], stem) == 0)
+      return 1;
+  return stem > strlen(STNS_FILTER_FILE) && strncmp(name, STNS_FILTER_FILE, strlen(STNS_FILTER_FILE)) == 0;
 }
 
-static void delete_cache_files(stns_conf_t *c)
+void stns_cache_files_gc(stns_conf_t *c)
 {
-  DIR *dp;
   struct dirent *ent;
   struct stat statbuf;
   unsigned long now = time(NULL);
-  char dir[MAXBUF];
-  snprintf(dir, sizeof(dir), "%s/%d", c->cache_dir, geteuid());
+  char root[MAXBUF];
+  char dir[MAXBUF + 4];
+  char file[MAXBUF * 2 + 2];
+  int n, temp;
 
-  if ((dp = opendir(dir)) == NULL) {
+  pthread_once(&gc_once, gc_init);
+  if (pthread_mutex_trylock(&gc_mutex) != 0)
+    return;
+  if (!stns_state_claim_gc(c)) {
+    pthread_mutex_unlock(&gc_mutex);
     return;
   }
 
-  char *buf = malloc(1);
-  while ((ent = readdir(dp)) != NULL) {
-    buf = (char *)realloc(buf, strlen(dir) + strlen(ent->d_name) + 2);
-    snprintf(buf, strlen(dir) + strlen(ent->d_name) + 2, "%s/%s", dir, ent->d_name);
+  snprintf(root, sizeof(root), "%s/%d", c->cache_dir, geteuid());
+  if (strcmp(gc_root, root) != 0) {
+    if (gc_dir != NULL)
+      closedir(gc_dir);
+    gc_dir   = NULL;
+    gc_shard = 0;
+    snprintf(gc_root, sizeof(gc_root), "%s", root);
+  }
 
-    if (stat(buf, &statbuf) == 0 && (statbuf.st_uid == geteuid() || geteuid() == 0)) {
-      unsigned long diff = now - statbuf.st_mtime;
+  // shards 0 to STNS_CACHE_SHARDS - 1, then the top directory
+  for (n = 0; n < STNS_CACHE_GC_BATCH; n++) {
+    if (gc_shard < STNS_CACHE_SHARDS)
+      snprintf(dir, sizeof(dir), "%s/%02x", root, gc_shard);
+    else
+      snprintf(dir, sizeof(dir), "%s", root);
+    if (gc_dir == NULL && (gc_dir = opendir(dir)) == NULL) {
+      gc_shard = (gc_shard + 1) % (STNS_CACHE_SHARDS + 1);
+      continue;
+    }
+    if ((ent = readdir(gc_dir)) == NULL) {
+      // the next pass over this directory sees the files created since
+      closedir(gc_dir);
+      gc_dir   = NULL;
+      gc_shard = (gc_shard + 1) % (STNS_CACHE_SHARDS + 1);
+      continue;
+    }
+    // dot files hold process-independent state such as TLS sessions, but
+    // the temporary files they are replaced through can be left behind
+    temp = gc_temp_file(ent->d_name, gc_shard < STNS_CACHE_SHARDS);
+    if (ent->d_name[0] == '.' && !temp)
+      continue;
+    snprintf(file, sizeof(file), "%s/%s", dir, ent->d_name);
+
+    if (stat(file, &statbuf) != 0 || (statbuf.st_uid != geteuid() && geteuid() != 0))
+      continue;
+    if (temp ? S_ISREG(statbuf.st_mode) && now - statbuf.st_mtime > STNS_CACHE_TEMP_TTL
+             : gc_expired(c, &statbuf, gc_shard < STNS_CACHE_SHARDS, now)) {
+      if (unlink(file) == -1) {
+        syslog(LOG_ERR, "%s(stns)[L%d] cannot delete %s: %s", __func__, __LINE__, file, strerror(errno));
+      }
+    } else if (!temp && gc_shard == STNS_CACHE_SHARDS && S_ISREG(statbuf.st_mode) && statbuf.st_uid == geteuid()) {
+      cache_file_migrate(c, ent->d_name, file, &statbuf);
+    }
+  }
+  pthread_mutex_unlock(&gc_mutex);
+}
 
-      if (!S_ISDIR(statbuf.st_mode) &&
-          ((diff > c->cache_ttl && statbuf.st_size > 0) || (diff > c->negative_cache_ttl && statbuf.st_size == 0))) {
+static int64_t request_now(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
 
-        if (unlink(buf) == -1) {
-          syslog(LOG_ERR, "%s(stns)[L%d] cannot delete %s: %s", __func__, __LINE__, buf, strerror(errno));
-        }
-      }
+// The pause before retry number attempt: request_backoff doubled per attempt
+// up to request_backoff_max, of which a random half is waited so that clients
+// failing together do not retry together.
+long stns_request_backoff(stns_conf_t *c, int attempt)
+{
+  struct timespec ts;
+  uint64_t x;
+  long delay = c->request_backoff;
+
+  while (attempt-- > 0 && delay < c->request_backoff_max)
+    delay *= 2;
+  if (delay > c->request_backoff_max)
+    delay = c->request_backoff_max;
+  if (delay <= 1)
+    return delay > 0 ? delay : 0;
+
+  // splitmix64 over the clock and the thread, leaving the rand() state of
+  // the application alone
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  x = ((uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec) ^ (uint64_t)(uintptr_t)pthread_self();
+  x += 0x9e3779b97f4a7c15ULL;
+  x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+  x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+  x ^= x >> 31;
+  return delay / 2 + (long)(x % (uint64_t)(delay - delay / 2 + 1));
+}
+
+// Every attempt of one lookup shares request_deadline milliseconds. An attempt
+// gets at most request_timeout seconds of it, the pauses between attempts
+// back off exponentially, and no retry starts that could not finish in time.
+static CURLcode http_request_with_retry(stns_conf_t *c, char *path, stns_response_t *res, int retry_count)
+{
+  int64_t deadline = request_now() + c->request_deadline;
+  int64_t remaining;
+  long timeout, backoff;
+  CURLcode result;
+  int attempt = 0;
+
+  for (;;) {
+    remaining = deadline - request_now();
+    timeout   = (long)c->request_timeout * 1000;
+    if (timeout <= 0 || timeout > remaining)
+      timeout = (long)remaining;
+    result = inner_http_request(c, path, res, timeout > 0 ? timeout : 1);
+    if (result == CURLE_OK || result == CURLE_HTTP_RETURNED_ERROR || retry_count-- <= 0)
+      return result;
+
+    backoff   = stns_request_backoff(c, attempt++);
+    remaining = deadline - request_now();
+    if (remaining <= backoff) {
+      syslog(LOG_NOTICE, "%s(stns)[L%d] request deadline of %d ms reached", __func__, __LINE__, c->request_deadline);
+      return result;
     }
+    syslog(LOG_NOTICE, "%s(stns)[L%d] %d retries remaining, next in %ld ms", __func__, __LINE__, retry_count + 1,
+           backoff);
+    if (backoff > 0)
+      usleep(backoff * 1000);
   }
-#ifdef DEBUG
-  syslog(LOG_ERR, "%s(stns)[L%d] before free", __func__, __LINE__);
-#endif
-  free(buf);
-  closedir(dp);
-#ifdef DEBUG
-  syslog(LOG_ERR, "%s(stns)[L%d] after free", __func__, __LINE__);
-#endif
-  return;
+}
+
+// Answer with an entry that is past cache_ttl but within cache_stale_ttl.
+static CURLcode stns_serve_stale(stns_response_t *res, stns_response_t *stale, const char *reason)
+{
+  syslog(LOG_NOTICE, "%s(stns)[L%d] serving a stale entry: %s", __func__, __LINE__, reason);
+  free(res->data);
+  res->data        = stale->data;
+  res->size        = stale->size;
+  res->status_code = (long)200;
+  res->stale       = 1;
+  return CURLE_OK;
 }
 
 int stns_request(stns_conf_t *c, char *path, stns_response_t *res)
 {
   CURLcode result;
+  stns_response_t stale = {NULL, 0, 0, 0};
+  int64_t lease         = 0;
+  int allowed;
   int retry_count  = c->request_retry;
   res->data        = (char *)malloc(sizeof(char));
   res->size        = 0;
   res->status_code = (long)200;
+  res->stale       = 0;
+  res->expires_at  = 0;
 
   if (path == NULL) {
     return CURLE_HTTP_RETURNED_ERROR;
   }
 
-  char *base = curl_escape(path, strlen(path));
-  char dpath[MAXBUF + 1];
-  char fpath[MAXBUF * 2 + 2];
-  snprintf(dpath, MAXBUF, "%s/%d", c->cache_dir, geteuid());
-  snprintf(fpath, MAXBUF * 2 + 2, "%s/%s", dpath, base);
-#ifdef DEBUG
-  syslog(LOG_ERR, "%s(stns)[L%d] before free", __func__, __LINE__);
-#endif
-  free(base);
-#ifdef DEBUG
-  syslog(LOG_ERR, "%s(stns)[L%d] after free", __func__, __LINE__);
-#endif
-
   if (c->cache && !c->cached_enable) {
-    struct stat statbuf;
-    if (stat(fpath, &statbuf) == 0 && statbuf.st_uid == geteuid()) {
-      unsigned long now  = time(NULL);
-      unsigned long diff = now - statbuf.st_mtime;
+    time_t expires_at;
+    if (stns_cache_get(c, path, res, &expires_at)) {
+      if (expires_at > time(NULL)) {
+        res->expires_at = expires_at;
+        return res->status_code == STNS_HTTP_NOTFOUND ? CURLE_HTTP_RETURNED_ERROR : CURLE_OK;
+      }
+      if (res->size > 0 && expires_at + c->cache_stale_ttl > time(NULL)) {
+        stale.data = res->data;
+        stale.size = res->size;
+        res->data  = (char *)malloc(sizeof(char));
+      }
+      res->size        = 0;
+      res->status_code = (long)200;
+    }
 
-      // resource notfound
-      if ((diff < c->cache_ttl && statbuf.st_size > 0) || (diff < c->negative_cache_ttl && statbuf.st_size == 0)) {
-        if (statbuf.st_size == 0) {
-          res->status_code = STNS_HTTP_NOTFOUND;
-          return CURLE_HTTP_RETURNED_ERROR;
-        }
+    time_t stored_at;
+    stns_response_t file = {NULL, 0, 0, 0};
+    if (stns_cache_file_get(c, path, &file, &stored_at)) {
+      unsigned long diff = time(NULL) - stored_at;
 
-        if (!stns_import_file(fpath, res)) {
-          goto request;
-        }
-        res->size = strlen(res->data);
-        return CURLE_OK;
+      // resource notfound
+      if ((diff < c->cache_ttl && file.size > 0) || (diff < c->negative_cache_ttl && file.size == 0)) {
+        free(res->data);
+        res->data        = file.data;
+        res->size        = file.size;
+        res->status_code = file.status_code;
+        res->expires_at  = stored_at + (file.size > 0 ? c->cache_ttl : c->negative_cache_ttl);
+        return file.size == 0 ? CURLE_HTTP_RETURNED_ERROR : CURLE_OK;
+      }
+      if (stale.data == NULL && file.size > 0 && diff < c->cache_ttl + c->cache_stale_ttl) {
+        stale.data = file.data;
+        stale.size = file.size;
       } else {
-        delete_cache_files(c);
+        free(file.data);
       }
+      stns_cache_files_gc(c);
     }
   }
 
-request:
-  if (!stns_request_available(STNS_LOCK_FILE, c))
+  // while one caller revalidates a stale entry the others are answered with it
+  if (stale.data != NULL && c->cache_stale_while_revalidate && !stns_state_claim_refresh(c, path, &lease))
+    return stns_serve_stale(res, &stale, "being revalidated");
+
+  if ((allowed = stns_breaker_allow(c)) == STNS_BREAKER_REJECT) {
+    stns_state_release_refresh(c, path, lease);
+    if (stale.data != NULL)
+      return stns_serve_stale(res, &stale, "the circuit breaker is open");
     return CURLE_COULDNT_CONNECT;
+  }
+  // a probe answers whether the server is back, retrying it only delays that
+  if (allowed == STNS_BREAKER_PROBE)
+    retry_count = 0;
 
   if (c->query_wrapper == NULL) {
-    result = inner_http_request(c, path, res);
-    while (1) {
-      if (result != CURLE_OK && retry_count > 0) {
-        if (result == CURLE_HTTP_RETURNED_ERROR) {
-          break;
-        }
-        sleep(1);
-        syslog(LOG_NOTICE, "%s(stns)[L%d] %d retries remaining", __func__, __LINE__, retry_count);
-        result = inner_http_request(c, path, res);
-        retry_count--;
-      } else {
-        break;
-      }
-    }
+    result = http_request_with_retry(c, path, res, retry_count);
   } else {
     result = stns_exec_cmd(c->query_wrapper, path, res);
   }
 
-  if (result == CURLE_COULDNT_CONNECT) {
-    stns_make_lockfile(STNS_LOCK_FILE);
+  stns_breaker_done(c, allowed, result, res->status_code);
+  stns_state_release_refresh(c, path, lease);
+
+  // an answer from the server is cached, a failure to get one is not
+  if (result != CURLE_OK && res->status_code != STNS_HTTP_NOTFOUND) {
+    if (stale.data != NULL)
+      return stns_serve_stale(res, &stale, "the request failed");
+    return result;
   }
+  free(stale.data);
 
+  int ttl         = res->data != NULL && res->size > 0 ? c->cache_ttl : c->negative_cache_ttl;
+  res->expires_at = time(NULL) + ttl;
+  // bodies too large for a cache slot fall back to one file per query
   if (c->cache && !c->cached_enable) {
-    stns_export_file(dpath, fpath, res->data);
+    if (!stns_cache_put(c, path, res, ttl)) {
+      stns_cache_file_put(c, path, res);
+      stns_cache_files_gc(c);
+    }
   }
   return result;
 }
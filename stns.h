@@ -24,16 +24,164 @@
 #define STNS_MAX_BUFFER_SIZE (10 * 1024 * 1024)
 #define STNS_CONFIG_FILE "/etc/stns/client/stns.conf"
 #define MAXBUF 1024
-#define STNS_LOCK_FILE "/var/tmp/.stns.lock"
 #define STNS_HTTP_NOTFOUND 404L
 #define STNS_LOCK_RETRY 3
 #define STNS_LOCK_INTERVAL_MSEC 10
+#define STNS_TLS_SESSION_FILE ".tls_sessions"
+#define STNS_TLS_SESSION_MAGIC "STNSTLS1"
+#define STNS_TLS_SESSION_MAX_SIZE (64 * 1024)
+#define STNS_CACHE_FILE ".cache"
+#define STNS_CACHE_MAGIC 0x534e5453
+#define STNS_CACHE_VERSION 1
+#define STNS_CACHE_HEADER_SIZE 4096
+#define STNS_CACHE_SLOTS 4096
+#define STNS_CACHE_SLOT_SIZE 4096
+#define STNS_CACHE_PROBE 8
+#define STNS_CACHE_READ_RETRY 4
+#define STNS_CACHE_WRITE_TIMEOUT 5
+#define STNS_CACHE_TEMP_TTL 10
+#define STNS_CACHE_RECHECK_SEC 60
+#define STNS_CACHE_GC_BATCH 128
+#define STNS_CACHE_SHARDS 256
+#define STNS_CACHE_GC_INTERVAL 1
+#define STNS_STATE_FILE ".state"
+#define STNS_STATE_MAGIC 0x53544154
+#define STNS_STATE_VERSION 4
+#define STNS_STATE_SIZE 4096
+#define STNS_STATE_REFRESH_LEASES 64
+#define STNS_MEMO_TTL 2
+#define STNS_L1_ENTRIES 1024
+#define STNS_L1_PROBE 8
+#define STNS_L1_LOCKS 16
+#define STNS_FILTER_FILE ".filter."
+#define STNS_FILTER_MAGIC 0x464c5452
+#define STNS_FILTER_VERSION 1
+#define STNS_FILTER_BITS_PER_NAME 10
+#define STNS_FILTER_HASHES 7
+#define STNS_REJECT_EXACT 0x1
+#define STNS_REJECT_PREFIX 0x2
+#define STNS_BREAKER_CLOSED 0
+#define STNS_BREAKER_OPEN 1
+#define STNS_BREAKER_HALF_OPEN 2
+#define STNS_BREAKER_REJECT 0
+#define STNS_BREAKER_ALLOW 1
+#define STNS_BREAKER_PROBE 2
+#define STNS_BREAKER_TRIP_CONNECT 0x1
+#define STNS_BREAKER_TRIP_TIMEOUT 0x2
+#define STNS_BREAKER_TRIP_TLS 0x4
+#define STNS_BREAKER_TRIP_SERVER_ERROR 0x8
+#define STNS_BREAKER_TRIP_ALL 0xf
+#define STNS_JSON_START 0
+#define STNS_JSON_ARRAY 1
+#define STNS_JSON_DONE 2
+#define STNS_JSON_FILTER_NONE 0
+#define STNS_JSON_FILTER_NAME 1
+#define STNS_JSON_FILTER_ID 2
+#define STNS_ENUMERATION_INITIALIZER {NULL, NULL, 0, 0}
+// The highest and lowest ids the server reported, packed in one word per
+// kind so that both are read and written without a lock.
+#define STNS_ID_RANGE_user 0
+#define STNS_ID_RANGE_group 1
+#define STNS_ID_RANGE_SHIFT_highest 32
+#define STNS_ID_RANGE_SHIFT_lowest 0
+#define STNS_ID_RANGE_GET(range, highest_or_lowest)                                                                    \
+  ((int)(uint32_t)((range) >> STNS_ID_RANGE_SHIFT_##highest_or_lowest))
+#define STNS_ID_RANGE_SET(range, highest_or_lowest, id)                                                                \
+  (((range) & ~((uint64_t)0xffffffff << STNS_ID_RANGE_SHIFT_##highest_or_lowest)) |                                    \
+   ((uint64_t)(uint32_t)(id) << STNS_ID_RANGE_SHIFT_##highest_or_lowest))
 
 typedef struct stns_response_t stns_response_t;
 struct stns_response_t {
   char *data;
   size_t size;
   long status_code;
+  int stale;
+  // when a body that is not stale stops being fresh
+  time_t expires_at;
+};
+
+typedef struct stns_record_t stns_record_t;
+struct stns_record_t {
+  uint32_t size;
+  int32_t id;
+  int32_t group_id;
+  uint32_t nstrings;
+};
+
+typedef struct stns_breaker_t stns_breaker_t;
+struct stns_breaker_t {
+  uint32_t state;
+  uint32_t requests;
+  uint32_t failures;
+  uint32_t reserved;
+  int64_t window_start;
+  int64_t opened_at;
+};
+
+typedef struct stns_json_span_t stns_json_span_t;
+struct stns_json_span_t {
+  const char *p;
+  size_t len;
+  int escaped;
+};
+
+typedef struct stns_json_entry_t stns_json_entry_t;
+struct stns_json_entry_t {
+  long id;
+  long group_id;
+  stns_json_span_t name;
+  stns_json_span_t password;
+  stns_json_span_t gecos;
+  stns_json_span_t directory;
+  stns_json_span_t shell;
+  stns_json_span_t users;
+};
+
+typedef struct stns_snapshot_t stns_snapshot_t;
+
+typedef struct stns_cursor_t stns_cursor_t;
+struct stns_cursor_t {
+  stns_snapshot_t *snapshot;
+  size_t idx;
+};
+
+typedef struct stns_enumeration_t stns_enumeration_t;
+struct stns_enumeration_t {
+  stns_snapshot_t *current;
+  stns_snapshot_t *indexed;
+  pthread_key_t key;
+  int key_created;
+};
+
+typedef struct stns_json_t stns_json_t;
+struct stns_json_t {
+  const char *p;
+  int state;
+  int filter;
+  const char *name;
+  long id;
+};
+
+typedef struct stns_reject_range_t stns_reject_range_t;
+struct stns_reject_range_t {
+  long low;
+  long high;
+};
+
+typedef struct stns_reject_node_t stns_reject_node_t;
+struct stns_reject_node_t {
+  int32_t child;
+  int32_t sibling;
+  unsigned char ch;
+  unsigned char match;
+};
+
+typedef struct stns_reject_t stns_reject_t;
+struct stns_reject_t {
+  stns_reject_range_t *ranges;
+  size_t nranges;
+  stns_reject_node_t *nodes;
+  size_t nnodes;
 };
 
 typedef struct stns_user_httpheader_t stns_user_httpheader_t;
@@ -61,6 +209,7 @@ struct stns_conf_t {
   char *tls_cert;
   char *tls_key;
   char *tls_ca;
+  int tls_session_cache;
   int cached_enable;
   char *cached_unix_socket;
   stns_user_httpheaders_t *http_headers;
@@ -71,127 +220,351 @@ struct stns_conf_t {
   int request_timeout;
   int request_retry;
   int request_locktime;
+  int request_deadline;
+  int request_connect_timeout;
+  int request_backoff;
+  int request_backoff_max;
+  int circuit_breaker_failures;
+  int circuit_breaker_rate;
+  int circuit_breaker_window;
+  int circuit_breaker_trip_on;
   int cache;
   int cache_ttl;
+  int cache_stale_ttl;
+  int cache_stale_while_revalidate;
   int negative_cache_ttl;
+  int cache_slots;
+  int cache_l1_entries;
+  int cache_snapshot_lookups;
+  int cache_name_filter;
+  stns_reject_t reject_user;
+  stns_reject_t reject_group;
 };
 
 extern int stns_load_config(char *, stns_conf_t *);
 extern void stns_unload_config(stns_conf_t *);
+extern stns_conf_t *stns_acquire_config(char *);
+extern void stns_release_config(stns_conf_t *);
 extern int stns_request(stns_conf_t *, char *, stns_response_t *);
-extern int stns_request_available(char *, stns_conf_t *);
-extern void stns_make_lockfile(char *);
+extern long stns_request_backoff(stns_conf_t *, int);
+extern void stns_cache_files_gc(stns_conf_t *);
+extern void stns_export_file(char *, char *, char *);
+extern int stns_import_file(char *, stns_response_t *);
+extern void stns_cache_file_put(stns_conf_t *, const char *, stns_response_t *);
+extern int stns_cache_file_get(stns_conf_t *, const char *, stns_response_t *, time_t *);
+extern char *stns_cached_body(stns_conf_t *, char *, time_t *);
+extern int stns_cache_file_replace(const char *, const char *, size_t, const char *, size_t, time_t);
+extern int stns_filter_absent(stns_conf_t *, char *);
+extern int stns_filter_get(stns_conf_t *, const char *, const char *);
+extern int stns_filter_put(stns_conf_t *, const char *, const char *, time_t);
 extern int stns_exec_cmd(char *, char *, stns_response_t *);
+extern void stns_http_connection_stats(unsigned long *, unsigned long *);
+extern uint32_t stns_hash(const char *, size_t);
+extern uint64_t stns_hash64(const char *, size_t);
+extern int stns_cache_get(stns_conf_t *, const char *, stns_response_t *, time_t *);
+extern int stns_cache_put(stns_conf_t *, const char *, stns_response_t *, int);
+extern int stns_record_put(stns_conf_t *, const char *, int, int, char **, uint32_t);
+extern int stns_record_get(stns_conf_t *, const char *, stns_record_t *, char *, size_t);
+extern size_t stns_record_seed_limit(stns_conf_t *);
+extern void stns_record_put_notfound(stns_conf_t *, const char *);
+extern int stns_record_notfound(stns_conf_t *, const char *);
+extern size_t stns_record_encode(char *, int, int, char **, uint32_t);
+extern char *stns_record_string(char *, uint32_t);
+extern void stns_l1_reset(int);
+extern int stns_l1_get(const char *, stns_record_t *, char *, size_t);
+extern void stns_l1_put(const char *, const char *, size_t, time_t);
+extern uint64_t stns_state_get_id_range(stns_conf_t *, int);
+extern void stns_state_put_id_range(stns_conf_t *, int, uint64_t);
+extern stns_breaker_t *stns_state_breaker(stns_conf_t *);
+extern int stns_state_claim_refresh(stns_conf_t *, const char *, int64_t *);
+extern void stns_state_release_refresh(stns_conf_t *, const char *, int64_t);
+extern int stns_state_claim_gc(stns_conf_t *);
+extern int stns_breaker_trip_class(const char *);
+extern int stns_breaker_classify(CURLcode, long);
+extern int stns_breaker_allow(stns_conf_t *);
+extern void stns_breaker_done(stns_conf_t *, int, CURLcode, long);
+extern int stns_reject_add_range(stns_reject_t *, long, long);
+extern int stns_reject_add_ids(stns_reject_t *, const char *);
+extern int stns_reject_add_name(stns_reject_t *, const char *);
+extern void stns_reject_compile(stns_reject_t *);
+extern int stns_reject_id(const stns_reject_t *, long);
+extern int stns_reject_name(const stns_reject_t *, const char *);
+extern void stns_reject_free(stns_reject_t *);
+extern stns_snapshot_t *stns_snapshot_new(void);
+extern void stns_snapshot_ref(stns_snapshot_t *);
+extern void stns_snapshot_release(stns_snapshot_t *);
+extern int stns_snapshot_add(stns_snapshot_t *, int, int, char **, uint32_t);
+extern void stns_snapshot_shrink(stns_snapshot_t *);
+extern size_t stns_snapshot_count(const stns_snapshot_t *);
+extern int stns_snapshot_get(const stns_snapshot_t *, size_t, stns_record_t *, char *, size_t);
+extern int stns_snapshot_index_add(stns_snapshot_t *, long);
+extern void stns_snapshot_index(stns_snapshot_t *);
+extern int stns_snapshot_indexed(const stns_snapshot_t *);
+extern int stns_snapshot_find(const stns_snapshot_t *, const char *, stns_record_t *, char *, size_t);
+extern stns_cursor_t *stns_enumeration_start(stns_enumeration_t *, stns_snapshot_t *);
+extern stns_cursor_t *stns_enumeration_cursor(stns_enumeration_t *);
+extern void stns_enumeration_end(stns_enumeration_t *);
+extern void stns_enumeration_index(stns_enumeration_t *, stns_snapshot_t *, time_t);
+extern stns_snapshot_t *stns_enumeration_indexed(stns_enumeration_t *);
+extern void stns_memo_put(const char *, const void *, size_t, char *, char *, size_t);
+extern int stns_memo_get(const char *, void *, size_t, char *, size_t, char **);
+extern void stns_json_init(stns_json_t *, const char *);
+extern void stns_json_filter_name(stns_json_t *, const char *);
+extern void stns_json_filter_id(stns_json_t *, long);
+extern int stns_json_next_entry(stns_json_t *, stns_json_entry_t *);
+extern int stns_json_array_next(const stns_json_span_t *, const char **, stns_json_span_t *);
+extern int stns_json_copy(const stns_json_span_t *, char *, size_t);
+extern size_t stns_json_size(const stns_json_span_t *, const char *);
+extern int stns_json_eq(const stns_json_span_t *, const char *);
+extern char *stns_json_emit(const stns_json_span_t *, const char *, char **, size_t *);
 extern int stns_user_highest_query_available(int);
 extern int stns_user_lowest_query_available(int);
 extern int stns_group_highest_query_available(int);
 extern int stns_group_lowest_query_available(int);
+extern int stns_user_id_query_available(stns_conf_t *, int);
+extern int stns_group_id_query_available(stns_conf_t *, int);
 extern int pthread_mutex_retrylock(pthread_mutex_t *mutex);
 extern void set_user_highest_id(int);
 extern void set_user_lowest_id(int);
 extern void set_group_highest_id(int);
 extern void set_group_lowest_id(int);
+extern int get_user_highest_id(void);
+extern int get_user_lowest_id(void);
+extern int get_group_highest_id(void);
+extern int get_group_lowest_id(void);
 
-#define STNS_ENSURE_BY(method_key, key_type, key_name, json_type, json_key, match_method, resource, ltype)             \
-  enum nss_status ensure_##resource##_by_##method_key(char *data, stns_conf_t *c, key_type key_name,                   \
-                                                      struct resource *rbuf, char *buf, size_t buflen, int *errnop)    \
+#define STNS_ENSURE_BY(method_key, key_type, key_name, filter, filter_value, resource)                                 \
+  static enum nss_status resource##_by_##method_key(char *data, stns_conf_t *c, key_type key_name,                     \
+                                                    const char *memo_key, struct resource *rbuf, char *buf,            \
+                                                    size_t buflen, int *errnop)                                        \
   {                                                                                                                    \
-    int i;                                                                                                             \
-    JSON_Object *leaf;                                                                                                 \
-    JSON_Value *root = json_parse_string(data);                                                                        \
+    stns_json_t json;                                                                                                  \
+    stns_json_entry_t entry;                                                                                           \
+    enum nss_status result;                                                                                            \
+    int r;                                                                                                             \
+                                                                                                                       \
+    stns_json_init(&json, data);                                                                                       \
+    stns_json_filter_##filter(&json, filter_value);                                                                    \
+    if ((r = stns_json_next_entry(&json, &entry)) == 1) {                                                              \
+      result = resource##_ensure(c, &entry, rbuf, buf, buflen, errnop);                                                \
+      if (result == NSS_STATUS_TRYAGAIN && memo_key != NULL)                                                           \
+        resource##_memo_put(c, &entry, memo_key, buf);                                                                 \
+      return result;                                                                                                   \
+    }                                                                                                                  \
                                                                                                                        \
-    if (root == NULL) {                                                                                                \
+    if (r < 0) {                                                                                                       \
       syslog(LOG_ERR, "%s(stns)[L%d] json parse error", __func__, __LINE__);                                           \
       return NSS_STATUS_UNAVAIL;                                                                                       \
     }                                                                                                                  \
-    JSON_Array *root_array = json_value_get_array(root);                                                               \
-    for (i = 0; i < json_array_get_count(root_array); i++) {                                                           \
-      leaf = json_array_get_object(root_array, i);                                                                     \
-      if (leaf == NULL) {                                                                                              \
-        continue;                                                                                                      \
-      }                                                                                                                \
-      key_type current = json_object_get_##json_type(leaf, #json_key);                                                 \
+    return NSS_STATUS_NOTFOUND;                                                                                        \
+  }                                                                                                                    \
                                                                                                                        \
-      if (match_method) {                                                                                              \
-        ltype##_ENSURE(leaf);                                                                                          \
-        json_value_free(root);                                                                                         \
-        return NSS_STATUS_SUCCESS;                                                                                     \
-      }                                                                                                                \
+  enum nss_status ensure_##resource##_by_##method_key(char *data, stns_conf_t *c, key_type key_name,                   \
+                                                      struct resource *rbuf, char *buf, size_t buflen, int *errnop)    \
+  {                                                                                                                    \
+    return resource##_by_##method_key(data, c, key_name, NULL, rbuf, buf, buflen, errnop);                             \
+  }
+
+#define STNS_RELOCATE(p, from, to) (p) = (to) + ((char *)(p) - (from))
+
+// Lay the entry out once more in a buffer of exactly the size it needs, with
+// the alignment of the caller's buffer, and keep it for the retry.
+#define STNS_MEMO(resource)                                                                                            \
+  static void resource##_memo_put(stns_conf_t *c, stns_json_entry_t *e, const char *key, char *buf)                    \
+  {                                                                                                                    \
+    struct resource tmp;                                                                                               \
+    int err;                                                                                                           \
+    size_t pad  = (uintptr_t)buf & (sizeof(char *) - 1);                                                               \
+    size_t size = resource##_size(e, buf);                                                                             \
+    char *image = (char *)malloc(size + pad);                                                                          \
+                                                                                                                       \
+    if (image == NULL)                                                                                                 \
+      return;                                                                                                          \
+    if (resource##_ensure(c, e, &tmp, image + pad, size, &err) != NSS_STATUS_SUCCESS) {                                \
+      free(image);                                                                                                     \
+      return;                                                                                                          \
     }                                                                                                                  \
-    json_value_free(root);                                                                                             \
+    stns_memo_put(key, &tmp, sizeof(tmp), image, image + pad, size);                                                   \
+  }                                                                                                                    \
                                                                                                                        \
-    return NSS_STATUS_NOTFOUND;                                                                                        \
+  static enum nss_status resource##_memo_get(const char *key, struct resource *rbuf, char *buf, size_t buflen,         \
+                                             int *errnop)                                                              \
+  {                                                                                                                    \
+    char *from;                                                                                                        \
+                                                                                                                       \
+    switch (stns_memo_get(key, rbuf, sizeof(*rbuf), buf, buflen, &from)) {                                             \
+    case -1:                                                                                                           \
+      *errnop = ERANGE;                                                                                                \
+      return NSS_STATUS_TRYAGAIN;                                                                                      \
+    case 0:                                                                                                            \
+      return NSS_STATUS_NOTFOUND;                                                                                      \
+    }                                                                                                                  \
+    resource##_relocate(rbuf, from, buf);                                                                              \
+    return NSS_STATUS_SUCCESS;                                                                                         \
   }
 
-#define STNS_SET_DEFAULT_VALUE(buf, name, def)                                                                         \
-  char buf[MAXBUF];                                                                                                    \
-  if (name != NULL && strlen(name) > 0) {                                                                              \
-    strcpy(buf, name);                                                                                                 \
-  } else {                                                                                                             \
-    strcpy(buf, def);                                                                                                  \
-  }                                                                                                                    \
-  name = buf;
+#define STNS_SNAPSHOT_LOOKUP(resource, query)                                                                          \
+  static stns_snapshot_t *resource##_snapshot(char *, stns_conf_t *, int);                                             \
+                                                                                                                       \
+  static enum nss_status resource##_snapshot_lookup(stns_conf_t *c, const char *url, struct resource *rbuf, char *buf, \
+                                                    size_t buflen, int *errnop)                                        \
+  {                                                                                                                    \
+    stns_snapshot_t *s = stns_enumeration_indexed(&enumeration);                                                       \
+    stns_record_t rec;                                                                                                 \
+    time_t expires_at;                                                                                                 \
+    char *data;                                                                                                        \
+    int ret;                                                                                                           \
+                                                                                                                       \
+    if (s == NULL && (data = stns_cached_body(c, #query, &expires_at)) != NULL) {                                      \
+      s = resource##_snapshot(data, c, 1);                                                                             \
+      free(data);                                                                                                      \
+      if (s != NULL)                                                                                                   \
+        stns_enumeration_index(&enumeration, s, expires_at);                                                           \
+    }                                                                                                                  \
+    if (s == NULL)                                                                                                     \
+      return NSS_STATUS_UNAVAIL;                                                                                       \
+                                                                                                                       \
+    ret = stns_snapshot_find(s, url, &rec, buf, buflen);                                                               \
+    stns_snapshot_release(s);                                                                                          \
+    switch (ret) {                                                                                                     \
+    case -2:                                                                                                           \
+      return NSS_STATUS_UNAVAIL;                                                                                       \
+    case -1:                                                                                                           \
+      *errnop = ERANGE;                                                                                                \
+      return NSS_STATUS_TRYAGAIN;                                                                                      \
+    case 0:                                                                                                            \
+      return NSS_STATUS_NOTFOUND;                                                                                      \
+    }                                                                                                                  \
+    return resource##_record_decode(&rec, rbuf, buf, buflen, errnop);                                                  \
+  }
 
 #define STNS_GET_SINGLE_VALUE_METHOD(method, first, format, value, resource, query_available, id_shift)                \
   enum nss_status _nss_stns_##method(first, struct resource *rbuf, char *buf, size_t buflen, int *errnop)              \
   {                                                                                                                    \
     int curl_result;                                                                                                   \
+    enum nss_status result;                                                                                            \
     stns_response_t r;                                                                                                 \
-    stns_conf_t c;                                                                                                     \
+    stns_conf_t *c;                                                                                                    \
     char url[MAXBUF];                                                                                                  \
+    char key[MAXBUF + 16];                                                                                             \
                                                                                                                        \
-    if (stns_load_config(STNS_CONFIG_FILE, &c) != 0)                                                                   \
+    if ((c = stns_acquire_config(STNS_CONFIG_FILE)) == NULL)                                                           \
       return NSS_STATUS_UNAVAIL;                                                                                       \
     query_available;                                                                                                   \
     snprintf(url, sizeof(url), format, value id_shift);                                                                \
-    curl_result = stns_request(&c, url, &r);                                                                           \
+    snprintf(key, sizeof(key), #resource ":%s", url);                                                                  \
+                                                                                                                       \
+    /* The records kept in the process, then those in the cache file, are looked                                       \
+       at before anything else. Only the configuration, which the id shift of the                                      \
+       key comes from, and the reject rules, cheaper than a probe, go first. */                                        \
+    if (c->cache && !c->cached_enable) {                                                                               \
+      result = resource##_record_get(c, key, rbuf, buf, buflen, errnop);                                               \
+      if (result != NSS_STATUS_NOTFOUND || stns_record_notfound(c, key)) {                                             \
+        stns_release_config(c);                                                                                        \
+        return result;                                                                                                 \
+      }                                                                                                                \
+    }                                                                                                                  \
+                                                                                                                       \
+    if (c->cache_name_filter && stns_filter_absent(c, url)) {                                                          \
+      stns_release_config(c);                                                                                          \
+      return NSS_STATUS_NOTFOUND;                                                                                      \
+    }                                                                                                                  \
+                                                                                                                       \
+    result = resource##_memo_get(key, rbuf, buf, buflen, errnop);                                                      \
+    if (result != NSS_STATUS_NOTFOUND) {                                                                               \
+      stns_release_config(c);                                                                                          \
+      return result;                                                                                                   \
+    }                                                                                                                  \
+                                                                                                                       \
+    if (c->cache_snapshot_lookups) {                                                                                   \
+      result = resource##_snapshot_lookup(c, url, rbuf, buf, buflen, errnop);                                          \
+      if (result != NSS_STATUS_UNAVAIL) {                                                                              \
+        stns_release_config(c);                                                                                        \
+        return result;                                                                                                 \
+      }                                                                                                                \
+    }                                                                                                                  \
+                                                                                                                       \
+    curl_result = stns_request(c, url, &r);                                                                            \
                                                                                                                        \
     if (curl_result != CURLE_OK) {                                                                                     \
       free(r.data);                                                                                                    \
-      stns_unload_config(&c);                                                                                          \
       if (r.status_code == STNS_HTTP_NOTFOUND) {                                                                       \
+        if (c->cache && !c->cached_enable)                                                                             \
+          stns_record_put_notfound(c, key);                                                                            \
+        stns_release_config(c);                                                                                        \
         return NSS_STATUS_NOTFOUND;                                                                                    \
       }                                                                                                                \
+      stns_release_config(c);                                                                                          \
       return NSS_STATUS_UNAVAIL;                                                                                       \
     }                                                                                                                  \
                                                                                                                        \
-    int result = ensure_##resource##_by_##value(r.data, &c, value, rbuf, buf, buflen, errnop);                         \
+    result = resource##_by_##value(r.data, c, value, key, rbuf, buf, buflen, errnop);                                  \
+    if (result == NSS_STATUS_SUCCESS && c->cache && !c->cached_enable && !r.stale)                                     \
+      resource##_record_put(c, key, rbuf);                                                                             \
+    else if (result == NSS_STATUS_NOTFOUND && c->cache && !c->cached_enable && !r.stale)                               \
+      stns_record_put_notfound(c, key);                                                                                \
     free(r.data);                                                                                                      \
-    stns_unload_config(&c);                                                                                            \
+    stns_release_config(c);                                                                                            \
     return result;                                                                                                     \
   }
 
-#define SET_ATTRBUTE(type, name, attr)                                                                                 \
-  int name##_length = strlen(name) + 1;                                                                                \
+#define STNS_SET_ENTRIES(type, resource, query)                                                                        \
+  static stns_snapshot_t *resource##_snapshot(char *data, stns_conf_t *c, int fresh)                                   \
+  {                                                                                                                    \
+    stns_snapshot_t *s = stns_snapshot_new();                                                                          \
+    stns_json_t j;                                                                                                     \
+    stns_json_entry_t e;                                                                                               \
+    struct resource entry;                                                                                             \
+    char *scratch = NULL, *grown;                                                                                      \
+    size_t size, scratch_size = 0, seed = fresh ? stns_record_seed_limit(c) : 0;                                       \
+    int ret, err;                                                                                                      \
+    int indexed = fresh && c->cache_snapshot_lookups;                                                                  \
                                                                                                                        \
-  if (buflen < name##_length) {                                                                                        \
-    *errnop = ERANGE;                                                                                                  \
-    return NSS_STATUS_TRYAGAIN;                                                                                        \
+    if (s == NULL)                                                                                                     \
+      return NULL;                                                                                                     \
+    stns_json_init(&j, data);                                                                                          \
+    while ((ret = stns_json_next_entry(&j, &e)) == 1) {                                                                \
+      if ((size = resource##_size(&e, scratch)) > scratch_size) {                                                      \
+        if ((grown = (char *)realloc(scratch, size * 2)) == NULL) {                                                    \
+          ret = -1;                                                                                                    \
+          break;                                                                                                       \
+        }                                                                                                              \
+        scratch      = grown;                                                                                          \
+        scratch_size = size * 2;                                                                                       \
+      }                                                                                                                \
+      if (resource##_ensure(c, &e, &entry, scratch, scratch_size, &err) != NSS_STATUS_SUCCESS)                         \
+        continue;                                                                                                      \
+      if (!resource##_snapshot_add(s, &entry) || (indexed && !stns_snapshot_index_add(s, e.id))) {                     \
+        ret = -1;                                                                                                      \
+        break;                                                                                                         \
+      }                                                                                                                \
+      if (stns_snapshot_count(s) <= seed)                                                                              \
+        resource##_record_put(c, NULL, &entry);                                                                        \
+    }                                                                                                                  \
+    free(scratch);                                                                                                     \
+    if (ret < 0) {                                                                                                     \
+      stns_snapshot_release(s);                                                                                        \
+      return NULL;                                                                                                     \
+    }                                                                                                                  \
+    stns_snapshot_shrink(s);                                                                                           \
+    if (indexed)                                                                                                       \
+      stns_snapshot_index(s);                                                                                          \
+    return s;                                                                                                          \
   }                                                                                                                    \
                                                                                                                        \
-  strcpy(buf, name);                                                                                                   \
-  rbuf->type##_##attr = buf;                                                                                           \
-  buf += name##_length;                                                                                                \
-  buflen -= name##_length;
-
-#define STNS_SET_ENTRIES(type, ltype, resource, query)                                                                 \
-  enum nss_status inner_nss_stns_set##type##ent(char *data, stns_conf_t *c)                                            \
+  enum nss_status inner_nss_stns_set##type##ent(char *data, stns_conf_t *c, int stale, time_t expires_at)              \
   {                                                                                                                    \
-    if (pthread_mutex_retrylock(&type##ent_mutex) != 0)                                                                \
-      return NSS_STATUS_UNAVAIL;                                                                                       \
+    stns_snapshot_t *s = resource##_snapshot(data, c, !stale);                                                         \
                                                                                                                        \
-    entries          = NULL;                                                                                           \
-    entry_idx        = 0;                                                                                              \
-    JSON_Value *root = json_parse_string(data);                                                                        \
-    if (root == NULL) {                                                                                                \
-      pthread_mutex_unlock(&type##ent_mutex);                                                                          \
+    if (s == NULL) {                                                                                                   \
       syslog(LOG_ERR, "%s(stns)[L%d] json parse error", __func__, __LINE__);                                           \
       return NSS_STATUS_UNAVAIL;                                                                                       \
     }                                                                                                                  \
-                                                                                                                       \
-    entries = root;                                                                                                    \
-                                                                                                                       \
-    pthread_mutex_unlock(&type##ent_mutex);                                                                            \
+    /* the index answers lookups only as long as the body it was built from */                                         \
+    if (stns_snapshot_indexed(s))                                                                                      \
+      stns_enumeration_index(&enumeration, s, expires_at);                                                             \
+    if (stns_enumeration_start(&enumeration, s) == NULL)                                                               \
+      return NSS_STATUS_UNAVAIL;                                                                                       \
     return NSS_STATUS_SUCCESS;                                                                                         \
   }                                                                                                                    \
                                                                                                                        \
@@ -199,95 +572,77 @@ extern void set_group_lowest_id(int);
   {                                                                                                                    \
     int curl_result;                                                                                                   \
     stns_response_t r;                                                                                                 \
-    stns_conf_t c;                                                                                                     \
-    if (stns_load_config(STNS_CONFIG_FILE, &c) != 0)                                                                   \
+    stns_conf_t *c;                                                                                                    \
+    if ((c = stns_acquire_config(STNS_CONFIG_FILE)) == NULL)                                                           \
       return NSS_STATUS_UNAVAIL;                                                                                       \
                                                                                                                        \
-    curl_result = stns_request(&c, #query, &r);                                                                        \
+    curl_result = stns_request(c, #query, &r);                                                                         \
     if (curl_result != CURLE_OK) {                                                                                     \
       free(r.data);                                                                                                    \
-      stns_unload_config(&c);                                                                                          \
+      stns_release_config(c);                                                                                          \
       if (r.status_code == STNS_HTTP_NOTFOUND) {                                                                       \
         return NSS_STATUS_NOTFOUND;                                                                                    \
       }                                                                                                                \
       return NSS_STATUS_UNAVAIL;                                                                                       \
     }                                                                                                                  \
                                                                                                                        \
-    int result = inner_nss_stns_set##type##ent(r.data, &c);                                                            \
+    int result = inner_nss_stns_set##type##ent(r.data, c, r.stale, r.expires_at);                                      \
+    /* a fresh enumeration is what the filter of names is built from */                                                \
+    if (result == NSS_STATUS_SUCCESS && c->cache_name_filter && !r.stale && stns_filter_get(c, #query, "") < 0)        \
+      stns_filter_put(c, #query, r.data, r.expires_at - c->cache_ttl);                                                 \
     free(r.data);                                                                                                      \
-    stns_unload_config(&c);                                                                                            \
+    stns_release_config(c);                                                                                            \
     return result;                                                                                                     \
   }                                                                                                                    \
                                                                                                                        \
   enum nss_status _nss_stns_end##type##ent(void)                                                                       \
   {                                                                                                                    \
-    if (pthread_mutex_retrylock(&type##ent_mutex) != 0)                                                                \
-      return NSS_STATUS_UNAVAIL;                                                                                       \
-    entry_idx = 0;                                                                                                     \
-    if (entry_idx != 0)                                                                                                \
-      json_value_free(entries);                                                                                        \
-    entries = NULL;                                                                                                    \
-    pthread_mutex_unlock(&type##ent_mutex);                                                                            \
+    stns_enumeration_end(&enumeration);                                                                                \
     return NSS_STATUS_SUCCESS;                                                                                         \
   }                                                                                                                    \
                                                                                                                        \
-  enum nss_status inner_nss_stns_get##type##ent_r(stns_conf_t *c, struct resource *rbuf, char *buf, size_t buflen,     \
-                                                  int *errnop)                                                         \
+  enum nss_status inner_nss_stns_get##type##ent_r(struct resource *rbuf, char *buf, size_t buflen, int *errnop)        \
   {                                                                                                                    \
-    enum nss_status ret       = NSS_STATUS_SUCCESS;                                                                    \
-    JSON_Array *array_entries = json_value_get_array(entries);                                                         \
-                                                                                                                       \
-    if (array_entries == NULL) {                                                                                       \
-      ret = _nss_stns_set##type##ent();                                                                                \
-    }                                                                                                                  \
-                                                                                                                       \
-    if (ret != NSS_STATUS_SUCCESS) {                                                                                   \
-      return ret;                                                                                                      \
-    }                                                                                                                  \
+    enum nss_status result;                                                                                            \
+    stns_record_t rec;                                                                                                 \
+    stns_cursor_t *cur = stns_enumeration_cursor(&enumeration);                                                        \
                                                                                                                        \
-    if (entry_idx >= json_array_get_count(array_entries)) {                                                            \
+    switch (cur == NULL ? 0 : stns_snapshot_get(cur->snapshot, cur->idx, &rec, buf, buflen)) {                         \
+    case -1:                                                                                                           \
+      *errnop = ERANGE;                                                                                                \
+      return NSS_STATUS_TRYAGAIN;                                                                                      \
+    case 0:                                                                                                            \
       *errnop = ENOENT;                                                                                                \
       return NSS_STATUS_NOTFOUND;                                                                                      \
     }                                                                                                                  \
                                                                                                                        \
-    JSON_Object *user = json_array_get_object(array_entries, entry_idx);                                               \
-                                                                                                                       \
-    ltype##_ENSURE(user);                                                                                              \
-    entry_idx++;                                                                                                       \
-    return NSS_STATUS_SUCCESS;                                                                                         \
+    result = resource##_record_decode(&rec, rbuf, buf, buflen, errnop);                                                \
+    if (result == NSS_STATUS_SUCCESS)                                                                                  \
+      cur->idx++;                                                                                                      \
+    return result;                                                                                                     \
   }                                                                                                                    \
                                                                                                                        \
   enum nss_status _nss_stns_get##type##ent_r(struct resource *rbuf, char *buf, size_t buflen, int *errnop)             \
   {                                                                                                                    \
-    stns_conf_t c;                                                                                                     \
-    if (stns_load_config(STNS_CONFIG_FILE, &c) != 0)                                                                   \
-      return NSS_STATUS_UNAVAIL;                                                                                       \
-    if (pthread_mutex_retrylock(&type##ent_mutex) != 0) {                                                              \
-      stns_unload_config(&c);                                                                                          \
-      return NSS_STATUS_UNAVAIL;                                                                                       \
-    }                                                                                                                  \
-    int result = inner_nss_stns_get##type##ent_r(&c, rbuf, buf, buflen, errnop);                                       \
-    pthread_mutex_unlock(&type##ent_mutex);                                                                            \
-    stns_unload_config(&c);                                                                                            \
-    return result;                                                                                                     \
+    enum nss_status result;                                                                                            \
+                                                                                                                       \
+    if (stns_enumeration_cursor(&enumeration) == NULL && (result = _nss_stns_set##type##ent()) != NSS_STATUS_SUCCESS)  \
+      return result;                                                                                                   \
+    return inner_nss_stns_get##type##ent_r(rbuf, buf, buflen, errnop);                                                 \
   }
 
 #define SET_GET_HIGH_LOW_ID(highest_or_lowest, user_or_group)                                                          \
   void set_##user_or_group##_##highest_or_lowest##_id(int id)                                                          \
   {                                                                                                                    \
-    if (pthread_mutex_retrylock(&user_or_group##_mutex) != 0)                                                          \
-      return;                                                                                                          \
-    highest_or_lowest##_##user_or_group##_id = id;                                                                     \
-    pthread_mutex_unlock(&user_or_group##_mutex);                                                                      \
+    uint64_t range = __atomic_load_n(&user_or_group##_id_range, __ATOMIC_RELAXED);                                     \
+    while (!__atomic_compare_exchange_n(&user_or_group##_id_range, &range,                                             \
+                                        STNS_ID_RANGE_SET(range, highest_or_lowest, id), 1, __ATOMIC_RELEASE,          \
+                                        __ATOMIC_RELAXED))                                                             \
+      ;                                                                                                                \
   }                                                                                                                    \
   int get_##user_or_group##_##highest_or_lowest##_id(void)                                                             \
   {                                                                                                                    \
-    int r;                                                                                                             \
-    if (pthread_mutex_retrylock(&user_or_group##_mutex) != 0)                                                          \
-      return 0;                                                                                                        \
-    r = highest_or_lowest##_##user_or_group##_id;                                                                      \
-    pthread_mutex_unlock(&user_or_group##_mutex);                                                                      \
-    return r;                                                                                                          \
+    return STNS_ID_RANGE_GET(__atomic_load_n(&user_or_group##_id_range, __ATOMIC_ACQUIRE), highest_or_lowest);         \
   }
 
 #define TOML_STR(m, empty)                                                                                             \
@@ -330,12 +685,47 @@ extern void set_group_lowest_id(int);
     return 1;                                                                                                          \
   }
 
+#define ID_RANGE_QUERY_AVAILABLE(user_or_group)                                                                        \
+  int stns_##user_or_group##_id_query_available(stns_conf_t *c, int id)                                                \
+  {                                                                                                                    \
+    uint64_t range = c != NULL ? stns_state_get_id_range(c, STNS_ID_RANGE_##user_or_group) : 0;                        \
+    int high, low;                                                                                                     \
+                                                                                                                       \
+    if (range == 0)                                                                                                    \
+      range = __atomic_load_n(&user_or_group##_id_range, __ATOMIC_ACQUIRE);                                            \
+    high = STNS_ID_RANGE_GET(range, highest);                                                                          \
+    low  = STNS_ID_RANGE_GET(range, lowest);                                                                           \
+    return (high == 0 || high >= id) && (low == 0 || low <= id);                                                       \
+  }
+
 #define USER_ID_QUERY_AVAILABLE                                                                                        \
-  if (!stns_user_highest_query_available(uid) || !stns_user_lowest_query_available(uid))                               \
-    return NSS_STATUS_NOTFOUND;
+  if (stns_reject_id(&c->reject_user, uid) || !stns_user_id_query_available(c, uid)) {                                 \
+    stns_release_config(c);                                                                                            \
+    return NSS_STATUS_NOTFOUND;                                                                                        \
+  }
 
 #define GROUP_ID_QUERY_AVAILABLE                                                                                       \
-  if (!stns_group_highest_query_available(gid) || !stns_group_lowest_query_available(gid))                             \
-    return NSS_STATUS_NOTFOUND;
+  if (stns_reject_id(&c->reject_group, gid) || !stns_group_id_query_available(c, gid)) {                               \
+    stns_release_config(c);                                                                                            \
+    return NSS_STATUS_NOTFOUND;                                                                                        \
+  }
+
+#define USER_NAME_QUERY_AVAILABLE                                                                                      \
+  if (stns_reject_name(&c->reject_user, name)) {                                                                       \
+    stns_release_config(c);                                                                                            \
+    return NSS_STATUS_NOTFOUND;                                                                                        \
+  }
+
+#define USER_ID_REJECTED                                                                                              \
+  if (stns_reject_id(&c->reject_user, uid)) {                                                                          \
+    stns_release_config(c);                                                                                            \
+    return NSS_STATUS_NOTFOUND;                                                                                        \
+  }
+
+#define GROUP_NAME_QUERY_AVAILABLE                                                                                     \
+  if (stns_reject_name(&c->reject_group, name)) {                                                                      \
+    stns_release_config(c);                                                                                            \
+    return NSS_STATUS_NOTFOUND;                                                                                        \
+  }
 
 #endif /* STNS_H */
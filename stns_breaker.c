@@ -0,0 +1,142 @@
+#include "stns.h"
+
+// A circuit breaker in front of the API. While closed every request goes
+// through and failures of the configured classes are counted over a window;
+// once they reach circuit_breaker.failures and circuit_breaker.rate percent
+// of the requests it opens, and lookups fail at once for request_locktime
+// seconds. Then a single request is let through as a probe: the breaker
+// closes when it succeeds and opens again when it fails.
+//
+// The breaker lives in the shared state page when there is one, so that all
+// processes of an euid see the same backend health, and in the process
+// otherwise.
+
+static stns_breaker_t local_breaker;
+
+static int64_t breaker_now(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_REALTIME, &ts);
+  return (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static stns_breaker_t *breaker_of(stns_conf_t *c)
+{
+  stns_breaker_t *b = stns_state_breaker(c);
+  return b != NULL ? b : &local_breaker;
+}
+
+int stns_breaker_trip_class(const char *name)
+{
+  if (strcmp(name, "connect") == 0)
+    return STNS_BREAKER_TRIP_CONNECT;
+  if (strcmp(name, "timeout") == 0)
+    return STNS_BREAKER_TRIP_TIMEOUT;
+  if (strcmp(name, "tls") == 0)
+    return STNS_BREAKER_TRIP_TLS;
+  if (strcmp(name, "server_error") == 0)
+    return STNS_BREAKER_TRIP_SERVER_ERROR;
+  return 0;
+}
+
+// The class of a failed request, 0 for a success or an answer from a healthy
+// server such as 404.
+int stns_breaker_classify(CURLcode result, long status_code)
+{
+  switch (result) {
+  case CURLE_OK:
+    return 0;
+  case CURLE_COULDNT_RESOLVE_PROXY:
+  case CURLE_COULDNT_RESOLVE_HOST:
+  case CURLE_COULDNT_CONNECT:
+  case CURLE_SEND_ERROR:
+  case CURLE_RECV_ERROR:
+  case CURLE_GOT_NOTHING:
+    return STNS_BREAKER_TRIP_CONNECT;
+  case CURLE_OPERATION_TIMEDOUT:
+    return STNS_BREAKER_TRIP_TIMEOUT;
+  case CURLE_SSL_CONNECT_ERROR:
+  case CURLE_PEER_FAILED_VERIFICATION:
+  case CURLE_SSL_CERTPROBLEM:
+  case CURLE_SSL_CIPHER:
+  case CURLE_SSL_CACERT_BADFILE:
+    return STNS_BREAKER_TRIP_TLS;
+  case CURLE_HTTP_RETURNED_ERROR:
+    return status_code >= 500 ? STNS_BREAKER_TRIP_SERVER_ERROR : 0;
+  default:
+    return 0;
+  }
+}
+
+// Returns STNS_BREAKER_REJECT when the request must not be made,
+// STNS_BREAKER_ALLOW when it may, and STNS_BREAKER_PROBE when it is the one
+// request that decides whether an open breaker closes again.
+int stns_breaker_allow(stns_conf_t *c)
+{
+  stns_breaker_t *b = breaker_of(c);
+  int64_t now       = breaker_now();
+  int64_t since, wait;
+  uint32_t state = __atomic_load_n(&b->state, __ATOMIC_ACQUIRE);
+
+  if (state == STNS_BREAKER_CLOSED)
+    return STNS_BREAKER_ALLOW;
+
+  // opened_at is when the breaker opened, or when the current probe started;
+  // a probe that never reports back is replaced once its deadline has passed.
+  since = __atomic_load_n(&b->opened_at, __ATOMIC_ACQUIRE);
+  wait  = state == STNS_BREAKER_OPEN ? (int64_t)c->request_locktime * 1000 : (int64_t)c->request_deadline + 1000;
+  if (now - since < wait)
+    return STNS_BREAKER_REJECT;
+  if (!__atomic_compare_exchange_n(&b->opened_at, &since, now, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+    return STNS_BREAKER_REJECT;
+  __atomic_store_n(&b->state, STNS_BREAKER_HALF_OPEN, __ATOMIC_RELEASE);
+  return STNS_BREAKER_PROBE;
+}
+
+static void breaker_open(stns_breaker_t *b, int64_t now)
+{
+  __atomic_store_n(&b->opened_at, now, __ATOMIC_RELEASE);
+  __atomic_store_n(&b->state, STNS_BREAKER_OPEN, __ATOMIC_RELEASE);
+}
+
+// Record the outcome of a request that stns_breaker_allow let through.
+void stns_breaker_done(stns_conf_t *c, int allowed, CURLcode result, long status_code)
+{
+  stns_breaker_t *b = breaker_of(c);
+  int64_t now       = breaker_now();
+  int failed        = (stns_breaker_classify(result, status_code) & c->circuit_breaker_trip_on) != 0;
+  int64_t start;
+  uint32_t requests, failures;
+
+  if (allowed == STNS_BREAKER_PROBE) {
+    if (failed) {
+      syslog(LOG_ERR, "%s(stns)[L%d] probe failed, the circuit breaker stays open", __func__, __LINE__);
+      breaker_open(b, now);
+      return;
+    }
+    __atomic_store_n(&b->requests, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&b->failures, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&b->window_start, now, __ATOMIC_RELAXED);
+    __atomic_store_n(&b->state, STNS_BREAKER_CLOSED, __ATOMIC_RELEASE);
+    return;
+  }
+
+  start = __atomic_load_n(&b->window_start, __ATOMIC_ACQUIRE);
+  if (now - start >= (int64_t)c->circuit_breaker_window * 1000 &&
+      __atomic_compare_exchange_n(&b->window_start, &start, now, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+    __atomic_store_n(&b->requests, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&b->failures, 0, __ATOMIC_RELAXED);
+  }
+
+  requests = __atomic_add_fetch(&b->requests, 1, __ATOMIC_RELAXED);
+  if (!failed)
+    return;
+  failures = __atomic_add_fetch(&b->failures, 1, __ATOMIC_RELAXED);
+  if (failures >= (uint32_t)c->circuit_breaker_failures &&
+      (uint64_t)failures * 100 >= (uint64_t)c->circuit_breaker_rate * requests &&
+      __atomic_load_n(&b->state, __ATOMIC_ACQUIRE) == STNS_BREAKER_CLOSED) {
+    syslog(LOG_ERR, "%s(stns)[L%d] %u of %u requests failed, the circuit breaker opens for %d seconds", __func__,
+           __LINE__, failures, requests, c->request_locktime);
+    breaker_open(b, now);
+  }
+}
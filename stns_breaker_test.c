@@ -0,0 +1,91 @@
+#include "stns_test.h"
+
+static stns_conf_t breaker_test_conf(void)
+{
+  stns_conf_t c;
+
+  c.cache                    = 0;
+  c.cached_enable            = 0;
+  c.request_timeout          = 3;
+  c.request_deadline         = 3000;
+  c.request_locktime         = 60;
+  c.circuit_breaker_failures = 2;
+  c.circuit_breaker_rate     = 0;
+  c.circuit_breaker_window   = 60;
+  c.circuit_breaker_trip_on  = STNS_BREAKER_TRIP_ALL;
+  return c;
+}
+
+Test(stns_breaker, classify)
+{
+  cr_assert_eq(stns_breaker_classify(CURLE_OK, 200), 0);
+  cr_assert_eq(stns_breaker_classify(CURLE_COULDNT_CONNECT, 0), STNS_BREAKER_TRIP_CONNECT);
+  cr_assert_eq(stns_breaker_classify(CURLE_OPERATION_TIMEDOUT, 0), STNS_BREAKER_TRIP_TIMEOUT);
+  cr_assert_eq(stns_breaker_classify(CURLE_SSL_CONNECT_ERROR, 0), STNS_BREAKER_TRIP_TLS);
+  cr_assert_eq(stns_breaker_classify(CURLE_HTTP_RETURNED_ERROR, 503), STNS_BREAKER_TRIP_SERVER_ERROR);
+  cr_assert_eq(stns_breaker_classify(CURLE_HTTP_RETURNED_ERROR, 404), 0);
+
+  cr_assert_eq(stns_breaker_trip_class("timeout"), STNS_BREAKER_TRIP_TIMEOUT);
+  cr_assert_eq(stns_breaker_trip_class("unknown"), 0);
+}
+
+Test(stns_breaker, trip_and_probe)
+{
+  stns_conf_t c = breaker_test_conf();
+
+  cr_assert_eq(stns_breaker_allow(&c), STNS_BREAKER_ALLOW);
+  stns_breaker_done(&c, STNS_BREAKER_ALLOW, CURLE_COULDNT_CONNECT, 0);
+  cr_assert_eq(stns_breaker_allow(&c), STNS_BREAKER_ALLOW);
+  // a 404 comes from a healthy server
+  stns_breaker_done(&c, STNS_BREAKER_ALLOW, CURLE_HTTP_RETURNED_ERROR, 404);
+  cr_assert_eq(stns_breaker_allow(&c), STNS_BREAKER_ALLOW);
+  stns_breaker_done(&c, STNS_BREAKER_ALLOW, CURLE_OPERATION_TIMEDOUT, 0);
+  cr_assert_eq(stns_breaker_allow(&c), STNS_BREAKER_REJECT);
+
+  // once request_locktime has passed exactly one request goes through
+  c.request_locktime = 0;
+  cr_assert_eq(stns_breaker_allow(&c), STNS_BREAKER_PROBE);
+  cr_assert_eq(stns_breaker_allow(&c), STNS_BREAKER_REJECT);
+
+  stns_breaker_done(&c, STNS_BREAKER_PROBE, CURLE_COULDNT_CONNECT, 0);
+  c.request_locktime = 60;
+  cr_assert_eq(stns_breaker_allow(&c), STNS_BREAKER_REJECT);
+
+  c.request_locktime = 0;
+  cr_assert_eq(stns_breaker_allow(&c), STNS_BREAKER_PROBE);
+  stns_breaker_done(&c, STNS_BREAKER_PROBE, CURLE_OK, 200);
+  c.request_locktime = 60;
+  cr_assert_eq(stns_breaker_allow(&c), STNS_BREAKER_ALLOW);
+}
+
+Test(stns_breaker, rate)
+{
+  stns_conf_t c = breaker_test_conf();
+  int i;
+
+  c.circuit_breaker_failures = 1;
+  c.circuit_breaker_rate     = 50;
+  c.circuit_breaker_trip_on  = STNS_BREAKER_TRIP_CONNECT;
+  // server errors are not configured to trip, so they count as requests only
+  for (i = 0; i < 2; i++) {
+    stns_breaker_done(&c, STNS_BREAKER_ALLOW, CURLE_OK, 200);
+    stns_breaker_done(&c, STNS_BREAKER_ALLOW, CURLE_HTTP_RETURNED_ERROR, 500);
+  }
+  for (i = 0; i < 3; i++) {
+    stns_breaker_done(&c, STNS_BREAKER_ALLOW, CURLE_COULDNT_CONNECT, 0);
+    cr_assert_eq(stns_breaker_allow(&c), STNS_BREAKER_ALLOW);
+  }
+  stns_breaker_done(&c, STNS_BREAKER_ALLOW, CURLE_COULDNT_CONNECT, 0);
+  cr_assert_eq(stns_breaker_allow(&c), STNS_BREAKER_REJECT);
+}
+
+Test(stns_breaker, shared)
+{
+  stns_conf_t c = cache_test_conf("/tmp/stns_breaker_test");
+
+  c.cache                    = 1;
+  c.circuit_breaker_failures = 1;
+  stns_breaker_done(&c, STNS_BREAKER_ALLOW, CURLE_COULDNT_CONNECT, 0);
+  cr_assert_eq(stns_state_breaker(&c)->state, STNS_BREAKER_OPEN);
+  cr_assert_eq(stns_breaker_allow(&c), STNS_BREAKER_REJECT);
+}
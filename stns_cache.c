@@ -0,0 +1,812 @@
+#include "stns.h"
+#include <fcntl.h>
+#include <sys/mman.h>
+
+// Responses that fit in a slot are kept in one memory-mapped file per euid,
+// cache_dir/<euid>/.cache, laid out as a header page followed by fixed size
+// slots addressed by open addressing on the hash of the query.
+//
+// Readers never lock: every slot carries a sequence number that writers make
+// odd while they own the slot, and readers retry when it changed under them.
+
+typedef struct stns_cache_header_t stns_cache_header_t;
+struct stns_cache_header_t {
+  uint32_t magic;
+  uint32_t version;
+  uint32_t slots;
+  uint32_t slot_size;
+};
+
+typedef struct stns_cache_slot_t stns_cache_slot_t;
+struct stns_cache_slot_t {
+  uint32_t seq;
+  uint32_t hash;
+  int64_t expires_at;
+  int64_t stored_at;
+  uint32_t key_len;
+  uint32_t value_len;
+  char data[];
+};
+
+typedef struct stns_cache_map_t stns_cache_map_t;
+struct stns_cache_map_t {
+  char path[MAXBUF];
+  char *base;
+  size_t size;
+  dev_t dev;
+  ino_t ino;
+  time_t checked_at;
+};
+
+// A single page next to the cache, cache_dir/<euid>/.state, for what the
+// processes of an euid learn from responses and share with each other.
+typedef struct stns_state_t stns_state_t;
+struct stns_state_t {
+  uint32_t magic;
+  uint32_t version;
+  uint64_t id_range[2];
+  int64_t id_range_expires_at[2];
+  stns_breaker_t breaker;
+  int64_t refresh_lease[STNS_STATE_REFRESH_LEASES];
+  int64_t gc_next_at;
+};
+
+// A Bloom filter of every name of users or of groups, cache_dir/<euid>/
+// .filter.users and .filter.groups, written whole and renamed into place.
+typedef struct stns_filter_t stns_filter_t;
+struct stns_filter_t {
+  uint32_t magic;
+  uint32_t version;
+  uint64_t bits;
+  uint32_t hashes;
+  uint32_t count;
+  int64_t built_at;
+};
+
+static pthread_mutex_t cache_mutex = PTHREAD_MUTEX_INITIALIZER;
+static stns_cache_map_t *cache_map = NULL;
+static stns_cache_map_t *state_map = NULL;
+static stns_cache_map_t *filter_map[2];
+
+uint32_t stns_hash(const char *key, size_t len)
+{
+  uint32_t h = 2166136261u;
+  size_t i;
+  for (i = 0; i < len; i++) {
+    h ^= (unsigned char)key[i];
+    h *= 16777619u;
+  }
+  return h;
+}
+
+uint64_t stns_hash64(const char *key, size_t len)
+{
+  uint64_t h = 14695981039346656037ull;
+  size_t i;
+  for (i = 0; i < len; i++) {
+    h ^= (unsigned char)key[i];
+    h *= 1099511628211ull;
+  }
+  return h;
+}
+
+static int cache_header_valid(void *base, size_t size)
+{
+  stns_cache_header_t *h = (stns_cache_header_t *)base;
+  return h->magic == STNS_CACHE_MAGIC && h->version == STNS_CACHE_VERSION && h->slot_size > sizeof(stns_cache_slot_t) &&
+         h->slots > 0 && STNS_CACHE_HEADER_SIZE + (size_t)h->slots * h->slot_size <= size;
+}
+
+// Build a fresh file aside and rename it into place, so that processes which
+// still map an older file never see it truncated under them.
+static int cache_create(stns_conf_t *c, char *path)
+{
+  char tmp[MAXBUF + 8];
+  stns_cache_header_t h;
+  int fd;
+  int slots = c->cache_slots > 0 ? c->cache_slots : STNS_CACHE_SLOTS;
+
+  snprintf(tmp, sizeof(tmp), "%s.XXXXXX", path);
+  if ((fd = mkstemp(tmp)) < 0)
+    return -1;
+
+  h.magic     = STNS_CACHE_MAGIC;
+  h.version   = STNS_CACHE_VERSION;
+  h.slots     = slots;
+  h.slot_size = STNS_CACHE_SLOT_SIZE;
+  if (ftruncate(fd, STNS_CACHE_HEADER_SIZE + (off_t)slots * STNS_CACHE_SLOT_SIZE) != 0 ||
+      write(fd, &h, sizeof(h)) != sizeof(h) || rename(tmp, path) != 0) {
+    close(fd);
+    unlink(tmp);
+    return -1;
+  }
+  return fd;
+}
+
+static int state_create(stns_conf_t *c, char *path)
+{
+  char tmp[MAXBUF + 8];
+  stns_state_t h;
+  int fd;
+
+  snprintf(tmp, sizeof(tmp), "%s.XXXXXX", path);
+  if ((fd = mkstemp(tmp)) < 0)
+    return -1;
+
+  memset(&h, 0, sizeof(h));
+  h.magic   = STNS_STATE_MAGIC;
+  h.version = STNS_STATE_VERSION;
+  if (ftruncate(fd, STNS_STATE_SIZE) != 0 || write(fd, &h, sizeof(h)) != sizeof(h) || rename(tmp, path) != 0) {
+    close(fd);
+    unlink(tmp);
+    return -1;
+  }
+  return fd;
+}
+
+static int state_valid(void *base, size_t size)
+{
+  stns_state_t *h = (stns_state_t *)base;
+  return h->magic == STNS_STATE_MAGIC && h->version == STNS_STATE_VERSION;
+}
+
+// Map cache_dir/<euid>/<file>, creating it with create when it is missing and
+// recreating it when valid rejects it. *current keeps the mapping per file.
+static stns_cache_map_t *map_open(stns_conf_t *c, stns_cache_map_t **current, const char *file, size_t min_size,
+                                  int (*create)(stns_conf_t *, char *), int (*valid)(void *, size_t))
+{
+  char dir[MAXBUF];
+  char path[MAXBUF];
+  struct stat st;
+  stns_cache_map_t *m;
+  time_t now = time(NULL);
+  int fd;
+  void *base;
+
+  snprintf(dir, sizeof(dir), "%s/%d", c->cache_dir, geteuid());
+  snprintf(path, sizeof(path), "%s/%d/%s", c->cache_dir, geteuid(), file);
+
+  m = __atomic_load_n(current, __ATOMIC_ACQUIRE);
+  if (m != NULL && strcmp(m->path, path) == 0 &&
+      now - __atomic_load_n(&m->checked_at, __ATOMIC_RELAXED) < STNS_CACHE_RECHECK_SEC)
+    return m;
+
+  // Another process may have replaced the file; look at it again now and then.
+  pthread_mutex_lock(&cache_mutex);
+  m = *current;
+  if (m != NULL && strcmp(m->path, path) == 0 && stat(path, &st) == 0 && st.st_dev == m->dev &&
+      st.st_ino == m->ino) {
+    __atomic_store_n(&m->checked_at, now, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&cache_mutex);
+    return m;
+  }
+
+  if (stat(dir, &st) != 0) {
+    mode_t um = {0};
+    um        = umask(0);
+    mkdir(dir, S_IRUSR | S_IWUSR | S_IXUSR);
+    umask(um);
+  }
+
+  fd = open(path, O_RDWR | O_NOFOLLOW | O_CLOEXEC);
+  if (fd < 0 && errno == ENOENT)
+    fd = create(c, path);
+  if (fd < 0)
+    goto err;
+
+  if (fstat(fd, &st) != 0 || st.st_uid != geteuid() || (st.st_mode & (S_IWGRP | S_IWOTH)) ||
+      st.st_size < min_size) {
+    close(fd);
+    goto err;
+  }
+
+  base = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  if (base == MAP_FAILED)
+    goto err;
+
+  if (!valid(base, st.st_size)) {
+    munmap(base, st.st_size);
+    if ((fd = create(c, path)) >= 0)
+      close(fd);
+    goto err;
+  }
+
+  // A mapping that is being replaced may still be read by other threads, so
+  // the old one is intentionally left mapped.
+  m = (stns_cache_map_t *)malloc(sizeof(stns_cache_map_t));
+  if (m == NULL) {
+    munmap(base, st.st_size);
+    goto err;
+  }
+  snprintf(m->path, sizeof(m->path), "%s", path);
+  m->base       = (char *)base;
+  m->size       = st.st_size;
+  m->dev        = st.st_dev;
+  m->ino        = st.st_ino;
+  m->checked_at = now;
+  __atomic_store_n(current, m, __ATOMIC_RELEASE);
+  pthread_mutex_unlock(&cache_mutex);
+  return m;
+err:
+  pthread_mutex_unlock(&cache_mutex);
+  return NULL;
+}
+
+static stns_cache_map_t *cache_open(stns_conf_t *c)
+{
+  return map_open(c, &cache_map, STNS_CACHE_FILE, STNS_CACHE_HEADER_SIZE, cache_create, cache_header_valid);
+}
+
+static stns_state_t *state_open(stns_conf_t *c)
+{
+  stns_cache_map_t *m;
+
+  if (!c->cache || c->cached_enable)
+    return NULL;
+  if ((m = map_open(c, &state_map, STNS_STATE_FILE, STNS_STATE_SIZE, state_create, state_valid)) == NULL)
+    return NULL;
+  return (stns_state_t *)m->base;
+}
+
+static stns_cache_slot_t *cache_slot(stns_cache_map_t *m, uint32_t i)
+{
+  stns_cache_header_t *h = (stns_cache_header_t *)m->base;
+  return (stns_cache_slot_t *)(m->base + STNS_CACHE_HEADER_SIZE + (size_t)(i % h->slots) * h->slot_size);
+}
+
+static size_t cache_capacity(stns_cache_map_t *m)
+{
+  return ((stns_cache_header_t *)m->base)->slot_size - sizeof(stns_cache_slot_t);
+}
+
+// Copy the value stored for key into *dst, allocating it when *dst is NULL.
+// Returns 1 on a hit, 0 on a miss and -1 when dstlen is too small, in which
+// case len holds the size that is needed.
+static int cache_read(stns_conf_t *c, const char *key, char **dst, size_t dstlen, size_t *len, time_t *expires_at)
+{
+  stns_cache_map_t *m = cache_open(c);
+  stns_cache_slot_t *s;
+  size_t key_len = strlen(key);
+  uint32_t hash  = stns_hash(key, key_len);
+  uint32_t seq, i, value_len;
+  int64_t expires;
+  int retry;
+  char *data;
+
+  if (m == NULL)
+    return 0;
+
+  for (i = 0; i < STNS_CACHE_PROBE; i++) {
+    s = cache_slot(m, hash + i);
+    for (retry = 0; retry < STNS_CACHE_READ_RETRY; retry++) {
+      seq = __atomic_load_n(&s->seq, __ATOMIC_ACQUIRE);
+      if (seq == 0)
+        return 0;
+      if (seq & 1)
+        continue;
+      if (s->hash != hash || s->key_len != key_len || memcmp(s->data, key, key_len) != 0) {
+        if (__atomic_load_n(&s->seq, __ATOMIC_ACQUIRE) == seq)
+          break;
+        continue;
+      }
+
+      value_len = s->value_len;
+      expires   = s->expires_at;
+      if (key_len + value_len > cache_capacity(m))
+        continue;
+      if (*dst != NULL && value_len > dstlen) {
+        *len = value_len;
+        return -1;
+      }
+      data = *dst != NULL ? *dst : (char *)malloc(value_len + 1);
+      if (data == NULL)
+        return 0;
+      memcpy(data, s->data + key_len, value_len);
+
+      __atomic_thread_fence(__ATOMIC_ACQUIRE);
+      if (__atomic_load_n(&s->seq, __ATOMIC_RELAXED) != seq) {
+        if (*dst == NULL)
+          free(data);
+        continue;
+      }
+
+      if (*dst == NULL) {
+        data[value_len] = '\0';
+        *dst            = data;
+      }
+      *len        = value_len;
+      *expires_at = expires;
+      return 1;
+    }
+  }
+  return 0;
+}
+
+int stns_cache_get(stns_conf_t *c, const char *key, stns_response_t *res, time_t *expires_at)
+{
+  char *data = NULL;
+  size_t len;
+
+  if (cache_read(c, key, &data, 0, &len, expires_at) != 1)
+    return 0;
+
+  free(res->data);
+  res->data        = data;
+  res->size        = len;
+  res->status_code = len == 0 ? STNS_HTTP_NOTFOUND : 200;
+  return 1;
+}
+
+int stns_cache_put(stns_conf_t *c, const char *key, stns_response_t *res, int ttl)
+{
+  stns_cache_map_t *m;
+  stns_cache_slot_t *s;
+  stns_cache_slot_t *target = NULL;
+  size_t key_len            = strlen(key);
+  size_t value_len          = res->data != NULL ? res->size : 0;
+  uint32_t hash             = stns_hash(key, key_len);
+  time_t now                = time(NULL);
+  int64_t oldest            = INT64_MAX;
+  uint32_t seq, owned, i;
+
+  if ((m = cache_open(c)) == NULL || key_len + value_len > cache_capacity(m))
+    return 0;
+
+  // Prefer the slot already holding this key, then an unused one, then the
+  // one that expires first within the probe window.
+  for (i = 0; i < STNS_CACHE_PROBE; i++) {
+    s   = cache_slot(m, hash + i);
+    seq = __atomic_load_n(&s->seq, __ATOMIC_ACQUIRE);
+    if (seq == 0) {
+      target = s;
+      break;
+    }
+    if (s->hash == hash && s->key_len == key_len && memcmp(s->data, key, key_len) == 0) {
+      target = s;
+      break;
+    }
+    if (s->expires_at < oldest) {
+      oldest = s->expires_at;
+      target = s;
+    }
+  }
+
+  // A slot being written by someone else is not waited for, and the caller
+  // keeps the response elsewhere. One that has been odd for longer than any
+  // write takes belongs to a writer that died, and is taken over while
+  // staying odd, so that a writer that was only slow cannot finish it.
+  if (target == NULL)
+    return 0;
+  seq = __atomic_load_n(&target->seq, __ATOMIC_RELAXED);
+  if ((seq & 1) && target->stored_at + STNS_CACHE_WRITE_TIMEOUT > now)
+    return 0;
+  owned = (seq & 1) ? seq + 2 : seq + 1;
+  if (!__atomic_compare_exchange_n(&target->seq, &seq, owned, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+    return 0;
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+
+  target->stored_at  = now;
+  target->hash       = hash;
+  target->expires_at = now + ttl;
+  target->key_len    = key_len;
+  target->value_len  = value_len;
+  memcpy(target->data, key, key_len);
+  if (value_len > 0)
+    memcpy(target->data + key_len, res->data, value_len);
+
+  return __atomic_compare_exchange_n(&target->seq, &owned, owned + 1, 0, __ATOMIC_RELEASE, __ATOMIC_RELAXED);
+}
+
+// A record is a decoded passwd, group or shadow entry: a header, one offset
+// per string and the NUL terminated strings themselves. It is relocatable, so
+// a hit is copied as is into the caller's buffer and only the string pointers
+// have to be computed from the offsets.
+//
+// Writes the record to dst unless it is NULL and returns its size.
+size_t stns_record_encode(char *dst, int id, int group_id, char **strings, uint32_t n)
+{
+  stns_record_t h;
+  size_t size = sizeof(h) + n * sizeof(uint32_t);
+  uint32_t i, offset;
+
+  for (i = 0; i < n; i++)
+    size += strlen(strings[i]) + 1;
+  if (dst == NULL)
+    return size;
+
+  h.size     = size;
+  h.id       = id;
+  h.group_id = group_id;
+  h.nstrings = n;
+  memcpy(dst, &h, sizeof(h));
+
+  offset = sizeof(h) + n * sizeof(uint32_t);
+  for (i = 0; i < n; i++) {
+    size_t len = strlen(strings[i]) + 1;
+    memcpy(dst + sizeof(h) + i * sizeof(uint32_t), &offset, sizeof(offset));
+    memcpy(dst + offset, strings[i], len);
+    offset += len;
+  }
+  return size;
+}
+
+int stns_record_put(stns_conf_t *c, const char *key, int id, int group_id, char **strings, uint32_t n)
+{
+  stns_response_t r;
+  size_t size = stns_record_encode(NULL, id, group_id, strings, n);
+  int ret = 0;
+
+  r.data = (char *)malloc(size);
+  if (r.data == NULL)
+    return 0;
+  r.size = stns_record_encode(r.data, id, group_id, strings, n);
+
+  stns_l1_put(key, r.data, r.size, time(NULL) + c->cache_ttl);
+  if (size <= STNS_CACHE_SLOT_SIZE)
+    ret = stns_cache_put(c, key, &r, c->cache_ttl);
+  free(r.data);
+  return ret;
+}
+
+// How many entries of an enumeration are also stored as records, so that the
+// lookups by name and id that usually follow need no request. Each entry
+// takes two keys, and at most half of the slots go to them.
+size_t stns_record_seed_limit(stns_conf_t *c)
+{
+  if (!c->cache || c->cached_enable)
+    return 0;
+  return (c->cache_slots > 0 ? c->cache_slots : STNS_CACHE_SLOTS) / 4;
+}
+
+// Remember in the process that the API did not know key.
+void stns_record_put_notfound(stns_conf_t *c, const char *key)
+{
+  stns_l1_put(key, NULL, 0, time(NULL) + c->negative_cache_ttl);
+}
+
+// Returns 1 when key is remembered as unknown to the API.
+int stns_record_notfound(stns_conf_t *c, const char *key)
+{
+  stns_record_t rec;
+  return stns_l1_get(key, &rec, NULL, 0) == 2;
+}
+
+// Returns 1 when a live record was copied into buf, 0 on a miss and -1 when
+// buflen is too small to hold it.
+int stns_record_get(stns_conf_t *c, const char *key, stns_record_t *rec, char *buf, size_t buflen)
+{
+  size_t len;
+  time_t expires_at;
+  uint32_t i, offset;
+  int r = stns_l1_get(key, rec, buf, buflen);
+
+  if (r == 1 || r == -1)
+    return r;
+  // a name the process already knows the API does not have
+  if (r == 2)
+    return 0;
+  if ((r = cache_read(c, key, &buf, buflen, &len, &expires_at)) != 1)
+    return r;
+  if (expires_at <= time(NULL) || len < sizeof(stns_record_t))
+    return 0;
+
+  memcpy(rec, buf, sizeof(stns_record_t));
+  if (rec->size != len || rec->nstrings > (len - sizeof(stns_record_t)) / sizeof(uint32_t) || buf[len - 1] != '\0')
+    return 0;
+  for (i = 0; i < rec->nstrings; i++) {
+    memcpy(&offset, buf + sizeof(stns_record_t) + i * sizeof(uint32_t), sizeof(offset));
+    if (offset >= len)
+      return 0;
+  }
+  stns_l1_put(key, buf, len, expires_at);
+  return 1;
+}
+
+char *stns_record_string(char *buf, uint32_t i)
+{
+  uint32_t offset;
+  memcpy(&offset, buf + sizeof(stns_record_t) + i * sizeof(uint32_t), sizeof(offset));
+  return buf + offset;
+}
+
+// The result of the last lookup that did not fit the caller's buffer is kept
+// per thread, as the filled buffer image and the structure pointing into it,
+// so that the retry glibc makes with a larger buffer is a copy plus pointer
+// relocation instead of another request and decode.
+typedef struct stns_memo_t stns_memo_t;
+struct stns_memo_t {
+  char key[MAXBUF + 16];
+  time_t stored_at;
+  union {
+    struct passwd pw;
+    struct group gr;
+    struct spwd sp;
+  } rbuf;
+  size_t rbuf_size;
+  char *image;
+  char *data;
+  size_t size;
+};
+
+static pthread_key_t memo_key;
+static pthread_once_t memo_once = PTHREAD_ONCE_INIT;
+
+static void memo_free(void *p)
+{
+  stns_memo_t *m = (stns_memo_t *)p;
+  free(m->image);
+  free(m);
+}
+
+static void memo_init(void)
+{
+  pthread_key_create(&memo_key, memo_free);
+}
+
+// Takes ownership of image; data is where the buffer contents start in it.
+void stns_memo_put(const char *key, const void *rbuf, size_t rbuf_size, char *image, char *data, size_t size)
+{
+  stns_memo_t *m;
+
+  pthread_once(&memo_once, memo_init);
+  m = (stns_memo_t *)pthread_getspecific(memo_key);
+  if (m == NULL && rbuf_size <= sizeof(m->rbuf)) {
+    m = (stns_memo_t *)calloc(1, sizeof(stns_memo_t));
+    if (m != NULL && pthread_setspecific(memo_key, m) != 0) {
+      free(m);
+      m = NULL;
+    }
+  }
+  if (m == NULL || rbuf_size > sizeof(m->rbuf)) {
+    free(image);
+    return;
+  }
+
+  free(m->image);
+  snprintf(m->key, sizeof(m->key), "%s", key);
+  memcpy(&m->rbuf, rbuf, rbuf_size);
+  m->stored_at = time(NULL);
+  m->rbuf_size = rbuf_size;
+  m->image     = image;
+  m->data      = data;
+  m->size      = size;
+}
+
+// Returns 1 when the memo for key was copied into buf and rbuf, in which case
+// *from is the address the pointers in rbuf are relative to, 0 when there is
+// none and -1 when buflen is still too small.
+int stns_memo_get(const char *key, void *rbuf, size_t rbuf_size, char *buf, size_t buflen, char **from)
+{
+  stns_memo_t *m;
+
+  pthread_once(&memo_once, memo_init);
+  m = (stns_memo_t *)pthread_getspecific(memo_key);
+  if (m == NULL || m->image == NULL || m->rbuf_size != rbuf_size || strcmp(m->key, key) != 0 ||
+      time(NULL) - m->stored_at > STNS_MEMO_TTL)
+    return 0;
+  // the image was laid out for a buffer with the same alignment
+  if ((((uintptr_t)buf ^ (uintptr_t)m->data) & (sizeof(char *) - 1)) != 0)
+    return 0;
+  if (buflen < m->size)
+    return -1;
+
+  memcpy(buf, m->data, m->size);
+  memcpy(rbuf, &m->rbuf, rbuf_size);
+  *from = m->data;
+  return 1;
+}
+
+// The id range hints of kind (STNS_ID_RANGE_user or STNS_ID_RANGE_group) last
+// learnt by any process of this euid, or 0 when there is none or it expired.
+uint64_t stns_state_get_id_range(stns_conf_t *c, int kind)
+{
+  stns_state_t *st = state_open(c);
+  uint64_t range;
+
+  if (st == NULL)
+    return 0;
+  range = __atomic_load_n(&st->id_range[kind], __ATOMIC_ACQUIRE);
+  if (__atomic_load_n(&st->id_range_expires_at[kind], __ATOMIC_RELAXED) <= time(NULL))
+    return 0;
+  return range;
+}
+
+// Either end that range leaves at 0 keeps what another process stored, as
+// long as that has not expired.
+void stns_state_put_id_range(stns_conf_t *c, int kind, uint64_t range)
+{
+  stns_state_t *st = state_open(c);
+  time_t now       = time(NULL);
+  uint64_t old, kept, merged;
+  int expired;
+
+  if (st == NULL)
+    return;
+  expired = __atomic_load_n(&st->id_range_expires_at[kind], __ATOMIC_RELAXED) <= now;
+  old     = __atomic_load_n(&st->id_range[kind], __ATOMIC_RELAXED);
+  do {
+    kept   = expired ? 0 : old;
+    merged = ((range >> 32 ? range : kept) & 0xffffffff00000000ull) |
+             ((range & 0xffffffffull ? range : kept) & 0xffffffffull);
+  } while (!__atomic_compare_exchange_n(&st->id_range[kind], &old, merged, 1, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+  __atomic_store_n(&st->id_range_expires_at[kind], (int64_t)now + c->cache_ttl, __ATOMIC_RELEASE);
+}
+
+stns_breaker_t *stns_state_breaker(stns_conf_t *c)
+{
+  stns_state_t *st = state_open(c);
+  return st != NULL ? &st->breaker : NULL;
+}
+
+static int64_t *state_refresh_lease(stns_state_t *st, const char *key)
+{
+  return &st->refresh_lease[stns_hash(key, strlen(key)) % STNS_STATE_REFRESH_LEASES];
+}
+
+// Claim the refresh of a stale key for the length of a request, so that one
+// process revalidates it while the others keep serving the stale value.
+// Returns 1 when the caller should refresh, with the lease to release in
+// *lease, and 0 when another refresh is under way. Keys share a lease when
+// they collide, which only delays one of the refreshes.
+int stns_state_claim_refresh(stns_conf_t *c, const char *key, int64_t *lease)
+{
+  stns_state_t *st = state_open(c);
+  struct timespec ts;
+  int64_t now, old, *p;
+
+  *lease = 0;
+  if (st == NULL)
+    return 1;
+  clock_gettime(CLOCK_REALTIME, &ts);
+  now = (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+  p   = state_refresh_lease(st, key);
+  old = __atomic_load_n(p, __ATOMIC_ACQUIRE);
+  if (old > now)
+    return 0;
+  *lease = now + c->request_deadline + 1000;
+  return __atomic_compare_exchange_n(p, &old, *lease, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE);
+}
+
+void stns_state_release_refresh(stns_conf_t *c, const char *key, int64_t lease)
+{
+  stns_state_t *st = state_open(c);
+
+  if (st == NULL || lease == 0)
+    return;
+  __atomic_compare_exchange_n(state_refresh_lease(st, key), &lease, 0, 0, __ATOMIC_RELEASE, __ATOMIC_RELAXED);
+}
+
+// Returns 1 when the caller is the process that collects the next batch of
+// expired query files, at most one every STNS_CACHE_GC_INTERVAL seconds.
+int stns_state_claim_gc(stns_conf_t *c)
+{
+  stns_state_t *st = state_open(c);
+  int64_t now      = time(NULL);
+  int64_t next;
+
+  if (st == NULL)
+    return 1;
+  next = __atomic_load_n(&st->gc_next_at, __ATOMIC_RELAXED);
+  return next <= now && __atomic_compare_exchange_n(&st->gc_next_at, &next, now + STNS_CACHE_GC_INTERVAL, 0,
+                                                    __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+}
+
+static int filter_create(stns_conf_t *c, char *path)
+{
+  return -1;
+}
+
+static int filter_valid(void *base, size_t size)
+{
+  stns_filter_t *h = (stns_filter_t *)base;
+  return h->magic == STNS_FILTER_MAGIC && h->version == STNS_FILTER_VERSION && h->bits > 0 && h->bits % 64 == 0 &&
+         h->hashes > 0 && size == sizeof(stns_filter_t) + h->bits / 8;
+}
+
+static int filter_kind(const char *query)
+{
+  if (strcmp(query, "users") == 0)
+    return 0;
+  if (strcmp(query, "groups") == 0)
+    return 1;
+  return -1;
+}
+
+// The positions of name are h1 + i * h2 for the first hashes values of i.
+static void filter_hashes(const char *name, uint64_t *h1, uint64_t *h2)
+{
+  uint64_t x = stns_hash64(name, strlen(name));
+
+  *h1 = x;
+  x   = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+  x   = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+  *h2 = (x ^ (x >> 31)) | 1;
+}
+
+// Returns 0 when the names of query definitely do not include name, 1 when
+// they may, and -1 when there is no filter built within cache_ttl.
+int stns_filter_get(stns_conf_t *c, const char *query, const char *name)
+{
+  char file[MAXBUF];
+  stns_cache_map_t *m;
+  stns_filter_t *h;
+  const uint64_t *bits;
+  uint64_t h1, h2, bit;
+  uint32_t i;
+  int kind = filter_kind(query);
+
+  if (kind < 0 || !c->cache || c->cached_enable)
+    return -1;
+  snprintf(file, sizeof(file), "%s%s", STNS_FILTER_FILE, query);
+
+  // a filter that expired may have been replaced by another process already
+  m = __atomic_load_n(&filter_map[kind], __ATOMIC_ACQUIRE);
+  if (m != NULL && ((stns_filter_t *)m->base)->built_at + c->cache_ttl <= time(NULL))
+    __atomic_store_n(&m->checked_at, 0, __ATOMIC_RELAXED);
+  if ((m = map_open(c, &filter_map[kind], file, sizeof(stns_filter_t), filter_create, filter_valid)) == NULL)
+    return -1;
+  h = (stns_filter_t *)m->base;
+  if (h->built_at + c->cache_ttl <= time(NULL))
+    return -1;
+
+  bits = (const uint64_t *)(m->base + sizeof(stns_filter_t));
+  filter_hashes(name, &h1, &h2);
+  for (i = 0; i < h->hashes; i++) {
+    bit = (h1 + i * h2) % h->bits;
+    if (!(bits[bit / 64] & (1ULL << (bit % 64))))
+      return 0;
+  }
+  return 1;
+}
+
+// Build the filter of query from data, its enumeration as the API returned it
+// at built_at, and put it in place of the previous one. Returns 0 on failure.
+int stns_filter_put(stns_conf_t *c, const char *query, const char *data, time_t built_at)
+{
+  char name[MAXBUF], dir[MAXBUF], file[MAXBUF + 32];
+  stns_json_t j;
+  stns_json_entry_t e;
+  stns_filter_t h;
+  uint64_t *bits, h1, h2, bit;
+  uint32_t i, count = 0;
+  int ret;
+
+  if (filter_kind(query) < 0)
+    return 0;
+  stns_json_init(&j, data);
+  while ((ret = stns_json_next_entry(&j, &e)) == 1)
+    count++;
+  if (ret < 0)
+    return 0;
+
+  memset(&h, 0, sizeof(h));
+  h.magic    = STNS_FILTER_MAGIC;
+  h.version  = STNS_FILTER_VERSION;
+  h.bits     = ((uint64_t)count * STNS_FILTER_BITS_PER_NAME + 1023) / 1024 * 1024;
+  h.hashes   = STNS_FILTER_HASHES;
+  h.count    = count;
+  h.built_at = built_at;
+  if (h.bits == 0)
+    h.bits = 1024;
+  if ((bits = (uint64_t *)calloc(h.bits / 64, sizeof(uint64_t))) == NULL)
+    return 0;
+
+  stns_json_init(&j, data);
+  while (stns_json_next_entry(&j, &e) == 1) {
+    if (e.name.p == NULL || stns_json_copy(&e.name, name, sizeof(name)) < 0)
+      continue;
+    filter_hashes(name, &h1, &h2);
+    for (i = 0; i < h.hashes; i++) {
+      bit = (h1 + i * h2) % h.bits;
+      bits[bit / 64] |= 1ULL << (bit % 64);
+    }
+  }
+
+  snprintf(dir, sizeof(dir), "%s/%d", c->cache_dir, geteuid());
+  snprintf(file, sizeof(file), "%s/%s%s", dir, STNS_FILTER_FILE, query);
+  mkdir(dir, S_IRUSR | S_IWUSR | S_IXUSR);
+  ret = stns_cache_file_replace(file, (char *)&h, sizeof(h), (char *)bits, h.bits / 8, 0);
+  free(bits);
+  return ret;
+}
@@ -0,0 +1,254 @@
+#include "stns_test.h"
+#include <fcntl.h>
+
+Test(stns_cache, put_and_get)
+{
+  stns_conf_t c = cache_test_conf("/tmp/stns_cache_put_and_get_test");
+  stns_response_t r;
+  time_t expires_at;
+  char *body = "{\"name\":\"test\"}";
+
+  r.data = NULL;
+  cr_assert_eq(stns_cache_get(&c, "users?name=test", &r, &expires_at), 0);
+
+  r.data = strdup(body);
+  r.size = strlen(body);
+  cr_assert_eq(stns_cache_put(&c, "users?name=test", &r, 10), 1);
+  free(r.data);
+
+  r.data = NULL;
+  cr_assert_eq(stns_cache_get(&c, "users?name=test", &r, &expires_at), 1);
+  cr_assert_str_eq(r.data, body);
+  cr_assert_eq(r.size, strlen(body));
+  cr_assert_eq(r.status_code, 200);
+  cr_assert(expires_at > time(NULL));
+  free(r.data);
+
+  r.data = NULL;
+  cr_assert_eq(stns_cache_get(&c, "users?name=other", &r, &expires_at), 0);
+}
+
+Test(stns_cache, notfound)
+{
+  stns_conf_t c = cache_test_conf("/tmp/stns_cache_notfound_test");
+  stns_response_t r;
+  time_t expires_at;
+
+  r.data = NULL;
+  r.size = 0;
+  cr_assert_eq(stns_cache_put(&c, "users?name=notfound", &r, 0), 1);
+
+  cr_assert_eq(stns_cache_get(&c, "users?name=notfound", &r, &expires_at), 1);
+  cr_assert_eq(r.size, 0);
+  cr_assert_eq(r.status_code, STNS_HTTP_NOTFOUND);
+  cr_assert(expires_at <= time(NULL));
+  free(r.data);
+}
+
+Test(stns_cache, overwrite)
+{
+  stns_conf_t c = cache_test_conf("/tmp/stns_cache_overwrite_test");
+  stns_response_t r;
+  time_t expires_at;
+
+  r.data = strdup("old");
+  r.size = 3;
+  stns_cache_put(&c, "users?id=1", &r, 10);
+  free(r.data);
+
+  r.data = strdup("new!");
+  r.size = 4;
+  stns_cache_put(&c, "users?id=1", &r, 10);
+  free(r.data);
+
+  r.data = NULL;
+  cr_assert_eq(stns_cache_get(&c, "users?id=1", &r, &expires_at), 1);
+  cr_assert_str_eq(r.data, "new!");
+  free(r.data);
+}
+
+// Leaves the slot holding key as a writer that died in the middle of a write
+// stored_at seconds ago would.
+static void cache_test_break_slot(stns_conf_t *c, const char *key, int64_t stored_at)
+{
+  char path[MAXBUF], slot[STNS_CACHE_SLOT_SIZE];
+  uint32_t seq;
+  off_t off;
+  int fd;
+
+  snprintf(path, sizeof(path), "%s/%d/%s", c->cache_dir, geteuid(), STNS_CACHE_FILE);
+  cr_assert((fd = open(path, O_RDWR)) >= 0);
+  for (off = STNS_CACHE_HEADER_SIZE; pread(fd, slot, sizeof(slot), off) == sizeof(slot); off += sizeof(slot)) {
+    if (memcmp(slot + 32, key, strlen(key)) != 0)
+      continue;
+    memcpy(&seq, slot, sizeof(seq));
+    seq |= 1;
+    cr_assert_eq(pwrite(fd, &seq, sizeof(seq), off), sizeof(seq));
+    cr_assert_eq(pwrite(fd, &stored_at, sizeof(stored_at), off + 16), sizeof(stored_at));
+    break;
+  }
+  close(fd);
+}
+
+Test(stns_cache, abandoned_write)
+{
+  stns_conf_t c = cache_test_conf("/tmp/stns_cache_abandoned_write_test");
+  stns_response_t r;
+  time_t expires_at;
+
+  r.data = strdup("old");
+  r.size = 3;
+  cr_assert_eq(stns_cache_put(&c, "users?id=1", &r, 10), 1);
+  free(r.data);
+
+  // a write that may still be running is not waited for
+  cache_test_break_slot(&c, "users?id=1", time(NULL));
+  r.data = strdup("new!");
+  r.size = 4;
+  cr_assert_eq(stns_cache_put(&c, "users?id=1", &r, 10), 0);
+
+  // one older than any write takes is taken over
+  cache_test_break_slot(&c, "users?id=1", time(NULL) - STNS_CACHE_WRITE_TIMEOUT - 1);
+  cr_assert_eq(stns_cache_put(&c, "users?id=1", &r, 10), 1);
+  free(r.data);
+
+  r.data = NULL;
+  cr_assert_eq(stns_cache_get(&c, "users?id=1", &r, &expires_at), 1);
+  cr_assert_str_eq(r.data, "new!");
+  free(r.data);
+}
+
+Test(stns_cache, too_large)
+{
+  stns_conf_t c = cache_test_conf("/tmp/stns_cache_too_large_test");
+  stns_response_t r;
+  time_t expires_at;
+
+  r.size = STNS_CACHE_SLOT_SIZE;
+  r.data = malloc(r.size + 1);
+  memset(r.data, 'a', r.size);
+  r.data[r.size] = '\0';
+  cr_assert_eq(stns_cache_put(&c, "users", &r, 10), 0);
+  free(r.data);
+
+  r.data = NULL;
+  cr_assert_eq(stns_cache_get(&c, "users", &r, &expires_at), 0);
+}
+
+Test(stns_record, put_and_get)
+{
+  stns_conf_t c = cache_test_conf("/tmp/stns_record_put_and_get_test");
+  stns_record_t rec;
+  char *strings[] = {"test", "x", "", "/home/test", "/bin/bash"};
+  char buf[MAXBUF];
+
+  c.cache_ttl = 10;
+  cr_assert_eq(stns_record_get(&c, "passwd:users?name=test", &rec, buf, sizeof(buf)), 0);
+  cr_assert_eq(stns_record_put(&c, "passwd:users?name=test", 1000, 2000, strings, 5), 1);
+
+  cr_assert_eq(stns_record_get(&c, "passwd:users?name=test", &rec, buf, sizeof(buf)), 1);
+  cr_assert_eq(rec.id, 1000);
+  cr_assert_eq(rec.group_id, 2000);
+  cr_assert_eq(rec.nstrings, 5);
+  cr_assert_str_eq(stns_record_string(buf, 0), "test");
+  cr_assert_str_eq(stns_record_string(buf, 1), "x");
+  cr_assert_str_eq(stns_record_string(buf, 2), "");
+  cr_assert_str_eq(stns_record_string(buf, 3), "/home/test");
+  cr_assert_str_eq(stns_record_string(buf, 4), "/bin/bash");
+
+  // a buffer that cannot hold the record asks the caller to retry
+  cr_assert_eq(stns_record_get(&c, "passwd:users?name=test", &rec, buf, 8), -1);
+}
+
+Test(stns_record, expired)
+{
+  stns_conf_t c = cache_test_conf("/tmp/stns_record_expired_test");
+  stns_record_t rec;
+  char *strings[] = {"group1", "x"};
+  char buf[MAXBUF];
+
+  c.cache_ttl = 0;
+  cr_assert_eq(stns_record_put(&c, "group:groups?name=group1", 1, 0, strings, 2), 1);
+  cr_assert_eq(stns_record_get(&c, "group:groups?name=group1", &rec, buf, sizeof(buf)), 0);
+}
+
+Test(stns_state, id_range)
+{
+  stns_conf_t c   = cache_test_conf("/tmp/stns_state_id_range_test");
+  c.cache         = 1;
+  c.cached_enable = 0;
+  c.cache_ttl     = 10;
+
+  cr_assert_eq(stns_state_get_id_range(&c, STNS_ID_RANGE_user), 0);
+  stns_state_put_id_range(&c, STNS_ID_RANGE_user, STNS_ID_RANGE_SET(0, lowest, 1000));
+  stns_state_put_id_range(&c, STNS_ID_RANGE_user, STNS_ID_RANGE_SET(0, highest, 20000));
+  cr_assert_eq(STNS_ID_RANGE_GET(stns_state_get_id_range(&c, STNS_ID_RANGE_user), lowest), 1000);
+  cr_assert_eq(STNS_ID_RANGE_GET(stns_state_get_id_range(&c, STNS_ID_RANGE_user), highest), 20000);
+  cr_assert_eq(stns_state_get_id_range(&c, STNS_ID_RANGE_group), 0);
+
+  // a process that has learnt nothing itself rejects ids out of the range
+  cr_assert_eq(stns_user_id_query_available(&c, 0), 0);
+  cr_assert_eq(stns_user_id_query_available(&c, 1000), 1);
+  cr_assert_eq(stns_group_id_query_available(&c, 0), 1);
+
+  c.cache_ttl = 0;
+  stns_state_put_id_range(&c, STNS_ID_RANGE_user, STNS_ID_RANGE_SET(0, lowest, 1000));
+  cr_assert_eq(stns_state_get_id_range(&c, STNS_ID_RANGE_user), 0);
+
+  c.cache     = 0;
+  c.cache_ttl = 10;
+  stns_state_put_id_range(&c, STNS_ID_RANGE_group, STNS_ID_RANGE_SET(0, lowest, 1000));
+  cr_assert_eq(stns_state_get_id_range(&c, STNS_ID_RANGE_group), 0);
+}
+
+Test(stns_filter, put_and_get)
+{
+  stns_conf_t c = cache_test_conf("/tmp/stns_filter_put_and_get_test");
+  char path[MAXBUF];
+  char *users = "[{\"id\":1,\"name\":\"user1\"},{\"id\":2,\"name\":\"user\\u0032\"}]";
+  int i, present = 0;
+
+  c.cache         = 1;
+  c.cached_enable = 0;
+  c.cache_ttl     = 10;
+  snprintf(path, sizeof(path), "%s/%d/%susers", c.cache_dir, geteuid(), STNS_FILTER_FILE);
+  unlink(path);
+  cr_assert_eq(stns_filter_get(&c, "users", "user1"), -1);
+
+  // a filter older than cache_ttl is not used, and its replacement is seen
+  cr_assert_eq(stns_filter_put(&c, "users", users, time(NULL) - 10), 1);
+  cr_assert_eq(stns_filter_get(&c, "users", "nobody"), -1);
+  cr_assert_eq(stns_filter_put(&c, "users", users, time(NULL)), 1);
+  cr_assert_eq(stns_filter_get(&c, "users", "user1"), 1);
+  cr_assert_eq(stns_filter_get(&c, "users", "user2"), 1);
+  for (i = 0; i < 1000; i++) {
+    snprintf(path, sizeof(path), "scanner%d", i);
+    present += stns_filter_get(&c, "users", path);
+  }
+  // 1024 bits for two names leave almost no false positives
+  cr_assert_lt(present, 5);
+  cr_assert_eq(stns_filter_get(&c, "groups", "user1"), -1);
+}
+
+Test(stns_memo, put_and_get)
+{
+  struct passwd pw, out;
+  char *image = malloc(64);
+  char *buf   = malloc(64);
+  char *from;
+
+  strcpy(image, "user1");
+  pw.pw_name = image;
+  pw.pw_uid  = 1;
+  stns_memo_put("passwd:users?name=user1", &pw, sizeof(pw), image, image, 6);
+
+  cr_assert_eq(stns_memo_get("passwd:users?name=user2", &out, sizeof(out), buf, 64, &from), 0);
+  cr_assert_eq(stns_memo_get("passwd:users?name=user1", &out, sizeof(out), buf, 5, &from), -1);
+  cr_assert_eq(stns_memo_get("passwd:users?name=user1", &out, sizeof(out), buf + 1, 63, &from), 0);
+  cr_assert_eq(stns_memo_get("passwd:users?name=user1", &out, sizeof(out), buf, 64, &from), 1);
+  STNS_RELOCATE(out.pw_name, from, buf);
+  cr_assert_eq(out.pw_name, buf);
+  cr_assert_str_eq(out.pw_name, "user1");
+  cr_assert_eq(out.pw_uid, 1);
+  free(buf);
+}
@@ -1,59 +1,417 @@
 #include "stns.h"
 
-static JSON_Value *entries  = NULL;
-static int entry_idx        = 0;
-pthread_mutex_t grent_mutex = PTHREAD_MUTEX_INITIALIZER;
-
-#define GROUP_ENSURE(entry)                                                                                            \
-  int id           = (int)json_value_get_number(json_object_get_value(entry, "id"));                                   \
-  const char *name = json_value_get_string(json_object_get_value(entry, "name"));                                      \
-  char passwd[]    = "x";                                                                                              \
-                                                                                                                       \
-  if (name == NULL) {                                                                                                  \
-    pthread_mutex_unlock(&grent_mutex);                                                                                \
-    return NSS_STATUS_NOTFOUND;                                                                                        \
-  }                                                                                                                    \
-  rbuf->gr_gid = c->gid_shift + id;                                                                                    \
-                                                                                                                       \
-  SET_ATTRBUTE(gr, name, name)                                                                                         \
-  SET_ATTRBUTE(gr, passwd, passwd)                                                                                     \
-  rbuf->gr_mem = (char **)buf;                                                                                         \
-                                                                                                                       \
-  JSON_Array *members = json_object_get_array(entry, "users");                                                         \
-  int i;                                                                                                               \
-  int ptr_area_size = (json_array_get_count(members) + 1) * sizeof(char *);                                            \
-  char *next_member;                                                                                                   \
-                                                                                                                       \
-  if (buflen < ptr_area_size) {                                                                                        \
-    (*errnop) = ERANGE;                                                                                                \
-    pthread_mutex_unlock(&grent_mutex);                                                                                \
-    return NSS_STATUS_TRYAGAIN;                                                                                        \
-  }                                                                                                                    \
-                                                                                                                       \
-  next_member = buf + ptr_area_size;                                                                                   \
-  buflen -= ptr_area_size;                                                                                             \
-  for (i = 0; i < json_array_get_count(members); i++) {                                                                \
-    const char *user = json_array_get_string(members, i);                                                              \
-    if (user == NULL) {                                                                                                \
-      continue;                                                                                                        \
-    }                                                                                                                  \
-    int user_length = strlen(user) + 1;                                                                                \
-    if (buflen < user_length) {                                                                                        \
-      *errnop = ERANGE;                                                                                                \
-      pthread_mutex_unlock(&grent_mutex);                                                                              \
-      return NSS_STATUS_TRYAGAIN;                                                                                      \
-    }                                                                                                                  \
-    strcpy(next_member, user);                                                                                         \
-    rbuf->gr_mem[i] = next_member;                                                                                     \
-    next_member += user_length;                                                                                        \
-    buflen -= user_length;                                                                                             \
-  }                                                                                                                    \
-  rbuf->gr_mem[json_array_get_count(members)] = NULL;
-
-STNS_ENSURE_BY(name, const char *, group_name, string, name, (strcmp(current, group_name) == 0), group, GROUP)
-STNS_ENSURE_BY(gid, gid_t, gid, number, id, current + (c->gid_shift) == gid, group, GROUP)
-
-STNS_GET_SINGLE_VALUE_METHOD(getgrnam_r, const char *name, "groups?name=%s", name, group, , )
+static stns_enumeration_t enumeration = STNS_ENUMERATION_INITIALIZER;
+
+// The name, the password and the members, as the strings of a record.
+static char **group_strings(struct group *rbuf, uint32_t *n)
+{
+  char **strings;
+  uint32_t members = 0;
+
+  while (rbuf->gr_mem[members] != NULL)
+    members++;
+  strings = (char **)malloc((members + 2) * sizeof(char *));
+  if (strings == NULL)
+    return NULL;
+  strings[0] = rbuf->gr_name;
+  strings[1] = rbuf->gr_passwd;
+  memcpy(strings + 2, rbuf->gr_mem, members * sizeof(char *));
+  *n = members + 2;
+  return strings;
+}
+
+// Stored under both the name and the gid, whichever key the lookup used.
+static void group_record_put(stns_conf_t *c, const char *key, struct group *rbuf)
+{
+  uint32_t n;
+  char **strings = group_strings(rbuf, &n);
+  char by[MAXBUF + 16];
+
+  if (strings == NULL)
+    return;
+  snprintf(by, sizeof(by), "group:groups?name=%s", rbuf->gr_name);
+  stns_record_put(c, by, rbuf->gr_gid - c->gid_shift, 0, strings, n);
+  snprintf(by, sizeof(by), "group:groups?id=%d", rbuf->gr_gid - c->gid_shift);
+  stns_record_put(c, by, rbuf->gr_gid - c->gid_shift, 0, strings, n);
+  free(strings);
+}
+
+static int group_snapshot_add(stns_snapshot_t *s, struct group *rbuf)
+{
+  uint32_t n;
+  char **strings = group_strings(rbuf, &n);
+  int ret;
+
+  if (strings == NULL)
+    return 0;
+  ret = stns_snapshot_add(s, rbuf->gr_gid, 0, strings, n);
+  free(strings);
+  return ret;
+}
+
+// The member pointers live right after the copied record, aligned for char *.
+static enum nss_status group_record_decode(stns_record_t *rec, struct group *rbuf, char *buf, size_t buflen,
+                                           int *errnop)
+{
+  size_t ptr_offset;
+  uint32_t i, n;
+
+  if (rec->nstrings < 2)
+    return NSS_STATUS_NOTFOUND;
+
+  n          = rec->nstrings - 2;
+  ptr_offset = rec->size + (-(uintptr_t)(buf + rec->size) & (sizeof(char *) - 1));
+  if (buflen < ptr_offset + (n + 1) * sizeof(char *)) {
+    *errnop = ERANGE;
+    return NSS_STATUS_TRYAGAIN;
+  }
+
+  rbuf->gr_gid    = rec->id;
+  rbuf->gr_name   = stns_record_string(buf, 0);
+  rbuf->gr_passwd = stns_record_string(buf, 1);
+  rbuf->gr_mem    = (char **)(buf + ptr_offset);
+  for (i = 0; i < n; i++)
+    rbuf->gr_mem[i] = stns_record_string(buf, i + 2);
+  rbuf->gr_mem[n] = NULL;
+  return NSS_STATUS_SUCCESS;
+}
+
+static enum nss_status group_record_get(stns_conf_t *c, const char *key, struct group *rbuf, char *buf, size_t buflen,
+                                        int *errnop)
+{
+  stns_record_t rec;
+  enum nss_status result;
+
+  switch (stns_record_get(c, key, &rec, buf, buflen)) {
+  case -1:
+    *errnop = ERANGE;
+    return NSS_STATUS_TRYAGAIN;
+  case 0:
+    return NSS_STATUS_NOTFOUND;
+  }
+
+  result = group_record_decode(&rec, rbuf, buf, buflen, errnop);
+  rbuf->gr_gid += c->gid_shift;
+  return result;
+}
+
+// The exact number of bytes group_ensure writes for e at buf, including the
+// padding that aligns the member pointers. *members is set to their count.
+static size_t group_layout(stns_json_entry_t *e, char *buf, size_t *members)
+{
+  stns_json_span_t user;
+  const char *cursor = NULL;
+  size_t head        = stns_json_size(&e->name, "") + 2;
+  size_t bytes       = 0;
+
+  *members = 0;
+  while (e->users.p != NULL && stns_json_array_next(&e->users, &cursor, &user) == 1) {
+    bytes += stns_json_size(&user, "");
+    (*members)++;
+  }
+  return head + (-(uintptr_t)(buf + head) & (sizeof(char *) - 1)) + (*members + 1) * sizeof(char *) + bytes;
+}
+
+static size_t group_size(stns_json_entry_t *e, char *buf)
+{
+  size_t members;
+  return group_layout(e, buf, &members);
+}
+
+// Members are counted first so that the pointer array, aligned for char *,
+// can be placed ahead of the member names.
+static enum nss_status group_ensure(stns_conf_t *c, stns_json_entry_t *e, struct group *rbuf, char *buf, size_t buflen,
+                                    int *errnop)
+{
+  stns_json_span_t user;
+  const char *cursor = NULL;
+  size_t n, i = 0, ptr_area_size;
+
+  if (e->name.p == NULL)
+    return NSS_STATUS_NOTFOUND;
+  if (buflen < group_layout(e, buf, &n))
+    goto erange;
+
+  rbuf->gr_gid = c->gid_shift + e->id;
+  if ((rbuf->gr_name = stns_json_emit(&e->name, "", &buf, &buflen)) == NULL ||
+      (rbuf->gr_passwd = stns_json_emit(NULL, "x", &buf, &buflen)) == NULL)
+    goto erange;
+
+  ptr_area_size = (-(uintptr_t)buf & (sizeof(char *) - 1)) + (n + 1) * sizeof(char *);
+  if (buflen < ptr_area_size)
+    goto erange;
+  rbuf->gr_mem = (char **)(buf + ptr_area_size - (n + 1) * sizeof(char *));
+  buf += ptr_area_size;
+  buflen -= ptr_area_size;
+
+  while (i < n && stns_json_array_next(&e->users, &cursor, &user) == 1) {
+    if ((rbuf->gr_mem[i++] = stns_json_emit(&user, "", &buf, &buflen)) == NULL)
+      goto erange;
+  }
+  rbuf->gr_mem[i] = NULL;
+  return NSS_STATUS_SUCCESS;
+erange:
+  *errnop = ERANGE;
+  return NSS_STATUS_TRYAGAIN;
+}
+
+static void group_relocate(struct group *rbuf, char *from, char *to)
+{
+  char **mem;
+
+  STNS_RELOCATE(rbuf->gr_name, from, to);
+  STNS_RELOCATE(rbuf->gr_passwd, from, to);
+  rbuf->gr_mem = (char **)(to + ((char *)rbuf->gr_mem - from));
+  for (mem = rbuf->gr_mem; *mem != NULL; mem++)
+    STNS_RELOCATE(*mem, from, to);
+}
+
+STNS_MEMO(group)
+STNS_SNAPSHOT_LOOKUP(group, groups)
+
+STNS_ENSURE_BY(name, const char *, group_name, name, group_name, group)
+STNS_ENSURE_BY(gid, gid_t, gid, id, (long)gid - c->gid_shift, group)
+
+STNS_GET_SINGLE_VALUE_METHOD(getgrnam_r, const char *name, "groups?name=%s", name, group, GROUP_NAME_QUERY_AVAILABLE,
+                             )
 STNS_GET_SINGLE_VALUE_METHOD(getgrgid_r, gid_t gid, "groups?id=%d", gid, group, GROUP_ID_QUERY_AVAILABLE,
-                             -(c.gid_shift))
-STNS_SET_ENTRIES(gr, GROUP, group, groups)
+                             -(c->gid_shift))
+STNS_SET_ENTRIES(gr, group, groups)
+
+// initgroups: glibc asks for the supplementary groups of a user at every
+// login. The groups list is turned into an index of (member, gid) pairs
+// sorted by member, which is kept while the list stays the same, and the
+// answer for each user is also stored in the shared cache. The list is told
+// apart by the expiry and the size of the body it came in, so that an index
+// is reused without looking at the body; a body of unknown age, stale or
+// never cached, is always indexed again.
+typedef struct stns_member_t stns_member_t;
+struct stns_member_t {
+  const char *name;
+  int32_t id;
+};
+
+typedef struct stns_member_index_t stns_member_index_t;
+struct stns_member_index_t {
+  time_t expires_at;
+  size_t len;
+  size_t size;
+  stns_member_t *members;
+  char *pool;
+};
+
+static pthread_mutex_t member_index_mutex = PTHREAD_MUTEX_INITIALIZER;
+static stns_member_index_t member_index   = {0, 0, 0, NULL, NULL};
+
+static int member_cmp(const void *a, const void *b)
+{
+  const stns_member_t *x = (const stns_member_t *)a;
+  const stns_member_t *y = (const stns_member_t *)b;
+  int r                  = strcmp(x->name, y->name);
+  return r != 0 ? r : (x->id > y->id) - (x->id < y->id);
+}
+
+static int member_index_build(stns_response_t *groups)
+{
+  stns_json_t json;
+  stns_json_entry_t entry;
+  stns_json_span_t user;
+  const char *cursor;
+  stns_member_t *members;
+  size_t size = 0, pool_size = 0, i = 0;
+  char *pool, *next;
+  int r;
+
+  stns_json_init(&json, groups->data);
+  while ((r = stns_json_next_entry(&json, &entry)) == 1) {
+    cursor = NULL;
+    while (entry.users.p != NULL && stns_json_array_next(&entry.users, &cursor, &user) == 1) {
+      size++;
+      pool_size += user.len + 1;
+    }
+  }
+  if (r < 0)
+    return -1;
+
+  members = (stns_member_t *)malloc((size + 1) * sizeof(stns_member_t));
+  pool    = (char *)malloc(pool_size + 1);
+  if (members == NULL || pool == NULL) {
+    free(members);
+    free(pool);
+    return -1;
+  }
+
+  next = pool;
+  stns_json_init(&json, groups->data);
+  while (i < size && stns_json_next_entry(&json, &entry) == 1) {
+    cursor = NULL;
+    while (i < size && entry.users.p != NULL && stns_json_array_next(&entry.users, &cursor, &user) == 1) {
+      int n = stns_json_copy(&user, next, pool + pool_size + 1 - next);
+      if (n < 0)
+        continue;
+      members[i].name = next;
+      members[i].id   = entry.id;
+      next += n + 1;
+      i++;
+    }
+  }
+  qsort(members, i, sizeof(stns_member_t), member_cmp);
+
+  free(member_index.members);
+  free(member_index.pool);
+  member_index.expires_at = groups->stale ? 0 : groups->expires_at;
+  member_index.len        = groups->size;
+  member_index.size       = i;
+  member_index.members    = members;
+  member_index.pool       = pool;
+  return 0;
+}
+
+// Collect the raw group ids that list user as a member into a malloc'ed array.
+static int member_index_lookup(stns_response_t *groups, const char *user, int32_t **ids, size_t *n)
+{
+  size_t lo = 0, hi, i;
+
+  pthread_mutex_lock(&member_index_mutex);
+  if ((member_index.members == NULL || member_index.expires_at == 0 || groups->stale ||
+       member_index.expires_at != groups->expires_at || member_index.len != groups->size) &&
+      member_index_build(groups) != 0) {
+    pthread_mutex_unlock(&member_index_mutex);
+    return -1;
+  }
+
+  hi = member_index.size;
+  while (lo < hi) {
+    size_t mid = lo + (hi - lo) / 2;
+    if (strcmp(member_index.members[mid].name, user) < 0)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  for (hi = lo; hi < member_index.size && strcmp(member_index.members[hi].name, user) == 0; hi++)
+    ;
+
+  *n   = hi - lo;
+  *ids = (int32_t *)malloc((*n + 1) * sizeof(int32_t));
+  if (*ids == NULL) {
+    pthread_mutex_unlock(&member_index_mutex);
+    return -1;
+  }
+  for (i = lo; i < hi; i++)
+    (*ids)[i - lo] = member_index.members[i].id;
+  pthread_mutex_unlock(&member_index_mutex);
+  return 0;
+}
+
+// Append gids following the glibc contract: grow *groupsp by doubling, never
+// beyond limit when it is positive, and leave out the primary group.
+static enum nss_status add_groups(stns_conf_t *c, int32_t *ids, size_t n, gid_t group, long int *start, long int *size,
+                                  gid_t **groupsp, long int limit, int *errnop)
+{
+  size_t i;
+  long int j;
+
+  for (i = 0; i < n; i++) {
+    gid_t gid = c->gid_shift + ids[i];
+    if (gid == group)
+      continue;
+    for (j = 0; j < *start && (*groupsp)[j] != gid; j++)
+      ;
+    if (j < *start)
+      continue;
+
+    if (*start == *size) {
+      long int newsize;
+      gid_t *newgroups;
+
+      if (limit > 0 && *size >= limit)
+        break;
+      newsize = *size > 0 ? *size * 2 : 8;
+      if (limit > 0 && newsize > limit)
+        newsize = limit;
+      newgroups = (gid_t *)realloc(*groupsp, newsize * sizeof(gid_t));
+      if (newgroups == NULL) {
+        *errnop = ENOMEM;
+        return NSS_STATUS_TRYAGAIN;
+      }
+      *groupsp = newgroups;
+      *size    = newsize;
+    }
+    (*groupsp)[(*start)++] = gid;
+  }
+  return NSS_STATUS_SUCCESS;
+}
+
+enum nss_status inner_nss_stns_initgroups_dyn(stns_response_t *groups, stns_conf_t *c, const char *user,
+                                              gid_t group, long int *start, long int *size, gid_t **groupsp,
+                                              long int limit, int *errnop)
+{
+  int32_t *ids;
+  size_t n;
+  enum nss_status ret;
+
+  if (member_index_lookup(groups, user, &ids, &n) != 0) {
+    syslog(LOG_ERR, "%s(stns)[L%d] cannot index groups", __func__, __LINE__);
+    return NSS_STATUS_UNAVAIL;
+  }
+  ret = add_groups(c, ids, n, group, start, size, groupsp, limit, errnop);
+  free(ids);
+  return ret;
+}
+
+enum nss_status _nss_stns_initgroups_dyn(const char *user, gid_t group, long int *start, long int *size,
+                                         gid_t **groupsp, long int limit, int *errnop)
+{
+  int curl_result;
+  enum nss_status ret;
+  stns_response_t r;
+  stns_conf_t *c;
+  char key[MAXBUF];
+  time_t expires_at;
+  int32_t *ids;
+  size_t n;
+  int use_cache;
+
+  if ((c = stns_acquire_config(STNS_CONFIG_FILE)) == NULL)
+    return NSS_STATUS_UNAVAIL;
+
+  snprintf(key, sizeof(key), "initgroups:%s", user);
+  use_cache = c->cache && !c->cached_enable;
+  r.data    = NULL;
+  if (use_cache && stns_cache_get(c, key, &r, &expires_at) && expires_at > time(NULL)) {
+    ret = add_groups(c, (int32_t *)r.data, r.size / sizeof(int32_t), group, start, size, groupsp, limit, errnop);
+    free(r.data);
+    stns_release_config(c);
+    return ret;
+  }
+  free(r.data);
+
+  curl_result = stns_request(c, "groups", &r);
+  if (curl_result != CURLE_OK) {
+    free(r.data);
+    stns_release_config(c);
+    if (r.status_code == STNS_HTTP_NOTFOUND) {
+      return NSS_STATUS_NOTFOUND;
+    }
+    return NSS_STATUS_UNAVAIL;
+  }
+
+  if (member_index_lookup(&r, user, &ids, &n) != 0) {
+    syslog(LOG_ERR, "%s(stns)[L%d] cannot index groups", __func__, __LINE__);
+    free(r.data);
+    stns_release_config(c);
+    return NSS_STATUS_UNAVAIL;
+  }
+  free(r.data);
+
+  // the groups of a user taken from a stale list are not cached again
+  if (use_cache && !r.stale) {
+    r.data = (char *)ids;
+    r.size = n * sizeof(int32_t);
+    stns_cache_put(c, key, &r, c->cache_ttl);
+  }
+  ret = add_groups(c, ids, n, group, start, size, groupsp, limit, errnop);
+  free(ids);
+  stns_release_config(c);
+  return ret;
+}
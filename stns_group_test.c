@@ -103,14 +103,16 @@ Test(inner_nss_stns_setgrent, ok)
   stns_conf_t c;
   stns_response_t r;
 
-  c.gid_shift = 0;
+  c.gid_shift              = 0;
+  c.cache                  = 0;
+  c.cache_snapshot_lookups = 0;
   readfile(f, &json);
-  code = inner_nss_stns_setgrent(json, &c);
+  code = inner_nss_stns_setgrent(json, &c, 0, time(NULL) + 10);
   cr_assert_eq(code, NSS_STATUS_SUCCESS);
 
   char *n = malloc(1);
   strcpy(n, "");
-  code = inner_nss_stns_setgrent(n, &c);
+  code = inner_nss_stns_setgrent(n, &c, 0, time(NULL) + 10);
   cr_assert_eq(code, NSS_STATUS_UNAVAIL);
   _nss_stns_endgrent();
 }
@@ -126,25 +128,144 @@ Test(inner_nss_stns_getgrent_r, ok)
   stns_conf_t c;
   stns_response_t r;
 
-  c.gid_shift = 0;
+  c.gid_shift              = 0;
+  c.cache                  = 0;
+  c.cache_snapshot_lookups = 0;
   readfile(f, &json);
-  code = inner_nss_stns_setgrent(json, &c);
+  code = inner_nss_stns_setgrent(json, &c, 0, time(NULL) + 10);
   cr_assert_eq(code, NSS_STATUS_SUCCESS);
 
-  code = inner_nss_stns_getgrent_r(&c, &grd, buffer, MAXBUF, &errnop);
+  code = inner_nss_stns_getgrent_r(&grd, buffer, MAXBUF, &errnop);
   cr_assert_eq(code, NSS_STATUS_SUCCESS);
   cr_assert_eq(code, NSS_STATUS_SUCCESS);
   cr_assert_str_eq(grd.gr_name, "group1");
   cr_assert_eq(grd.gr_gid, 1);
   cr_assert_str_eq(grd.gr_passwd, "x");
 
-  code = inner_nss_stns_getgrent_r(&c, &grd, buffer, MAXBUF, &errnop);
+  code = inner_nss_stns_getgrent_r(&grd, buffer, MAXBUF, &errnop);
   cr_assert_eq(code, NSS_STATUS_SUCCESS);
   cr_assert_str_eq(grd.gr_name, "group2");
   cr_assert_eq(grd.gr_gid, 2);
   cr_assert_str_eq(grd.gr_passwd, "x");
 
-  code = inner_nss_stns_getgrent_r(&c, &grd, buffer, MAXBUF, &errnop);
+  code = inner_nss_stns_getgrent_r(&grd, buffer, MAXBUF, &errnop);
   cr_assert_eq(code, NSS_STATUS_NOTFOUND);
   _nss_stns_endgrent();
 }
+
+Test(inner_nss_stns_getgrent_r, erange)
+{
+  char *f = "test/example2.json";
+  char *json;
+  int errnop = 0;
+  struct group grd;
+  char buffer[MAXBUF];
+  stns_conf_t c;
+
+  c.gid_shift              = 0;
+  c.cache                  = 0;
+  c.cache_snapshot_lookups = 0;
+  readfile(f, &json);
+  cr_assert_eq(inner_nss_stns_setgrent(json, &c, 0, time(NULL) + 10), NSS_STATUS_SUCCESS);
+
+  // a buffer that is too small does not move the cursor
+  cr_assert_eq(inner_nss_stns_getgrent_r(&grd, buffer, 16, &errnop), NSS_STATUS_TRYAGAIN);
+  cr_assert_eq(errnop, ERANGE);
+  cr_assert_eq(inner_nss_stns_getgrent_r(&grd, buffer, MAXBUF, &errnop), NSS_STATUS_SUCCESS);
+  cr_assert_str_eq(grd.gr_name, "group1");
+  _nss_stns_endgrent();
+}
+
+Test(ensure_group_by_name, erange)
+{
+  char *f = "test/example2.json";
+  char *json;
+  int code;
+  int errnop = 0;
+  struct group grd;
+  char buffer[MAXBUF];
+  stns_conf_t c;
+  c.gid_shift = 0;
+
+  readfile(f, &json);
+  code = ensure_group_by_name(json, &c, "group2", &grd, buffer, 16, &errnop);
+  cr_assert_eq(code, NSS_STATUS_TRYAGAIN);
+  cr_assert_eq(errnop, ERANGE);
+
+  code = ensure_group_by_name(json, &c, "group2", &grd, buffer, MAXBUF, &errnop);
+  cr_assert_eq(code, NSS_STATUS_SUCCESS);
+  cr_assert_eq((uintptr_t)grd.gr_mem % sizeof(char *), 0);
+  cr_assert_str_eq(grd.gr_mem[1], "bar");
+  cr_assert_null(grd.gr_mem[2]);
+  free(json);
+}
+
+Test(inner_nss_stns_initgroups_dyn, ok)
+{
+  char *data = "[{\"id\": 1, \"name\": \"group1\", \"users\": [\"test\", \"foo\"]},"
+               " {\"id\": 2, \"name\": \"group2\", \"users\": [\"foo\", \"bar\"]},"
+               " {\"id\": 3, \"name\": \"group3\", \"users\": [\"foo\"]}]";
+  stns_response_t body   = {data, strlen(data), 200, 0, time(NULL) + 10};
+  stns_response_t broken = {"[{\"id\": 1", 9, 200, 0, 0};
+  stns_conf_t c;
+  long int start = 1, size = 1;
+  gid_t *groups  = (gid_t *)malloc(sizeof(gid_t));
+  int errnop     = 0;
+  int code;
+
+  c.gid_shift = 100;
+  groups[0]   = 102;
+
+  // the primary group is skipped and the list grows as needed
+  code = inner_nss_stns_initgroups_dyn(&body, &c, "foo", 102, &start, &size, &groups, 0, &errnop);
+  cr_assert_eq(code, NSS_STATUS_SUCCESS);
+  cr_assert_eq(start, 3);
+  cr_assert_geq(size, 3);
+  cr_assert_eq(groups[0], 102);
+  cr_assert_eq(groups[1], 101);
+  cr_assert_eq(groups[2], 103);
+
+  // limit caps the list
+  start = 1;
+  size  = 1;
+  code  = inner_nss_stns_initgroups_dyn(&body, &c, "foo", 102, &start, &size, &groups, 2, &errnop);
+  cr_assert_eq(code, NSS_STATUS_SUCCESS);
+  cr_assert_eq(start, 2);
+  cr_assert_eq(size, 2);
+
+  start = 0;
+  code  = inner_nss_stns_initgroups_dyn(&body, &c, "nobody", 102, &start, &size, &groups, 0, &errnop);
+  cr_assert_eq(code, NSS_STATUS_SUCCESS);
+  cr_assert_eq(start, 0);
+
+  // the same cached body is not parsed again
+  broken.size       = body.size;
+  broken.expires_at = body.expires_at;
+  code              = inner_nss_stns_initgroups_dyn(&broken, &c, "foo", 102, &start, &size, &groups, 0, &errnop);
+  cr_assert_eq(code, NSS_STATUS_SUCCESS);
+
+  broken.size       = 9;
+  broken.expires_at = 0;
+  code              = inner_nss_stns_initgroups_dyn(&broken, &c, "foo", 102, &start, &size, &groups, 0, &errnop);
+  cr_assert_eq(code, NSS_STATUS_UNAVAIL);
+  free(groups);
+}
+
+Test(ensure_group_by_name, exact_size)
+{
+  char *f = "test/example2.json";
+  char *json;
+  int errnop = 0;
+  struct group grd;
+  char *buffer = malloc(MAXBUF);
+  stns_conf_t c;
+  c.gid_shift = 0;
+
+  // "group2" and "x", padding to the pointer array, 3 pointers, "foo" and "bar"
+  readfile(f, &json);
+  cr_assert_eq(ensure_group_by_name(json, &c, "group2", &grd, buffer, 47, &errnop), NSS_STATUS_TRYAGAIN);
+  cr_assert_eq(ensure_group_by_name(json, &c, "group2", &grd, buffer, 48, &errnop), NSS_STATUS_SUCCESS);
+  cr_assert_str_eq(grd.gr_mem[1], "bar");
+  free(buffer);
+  free(json);
+}
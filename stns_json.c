@@ -0,0 +1,436 @@
+#include "stns.h"
+
+// A single pass reader for the arrays of users and groups returned by the
+// STNS API. Instead of building a document it walks the text once, remembers
+// where the interesting fields of the current object are and skips everything
+// else, so a lookup allocates nothing and only the matching entry is decoded
+// into the caller's buffer.
+
+#define STREAM_MAX_DEPTH 64
+
+static const char *stream_ws(const char *p)
+{
+  while (*p == ' ' || *p == '\t' || *p == '\n' || *p == '\r')
+    p++;
+  return p;
+}
+
+static const char *stream_string(const char *p, stns_json_span_t *s)
+{
+  const char *start = ++p;
+  int escaped       = 0;
+
+  while (*p != '"') {
+    if (*p == '\0')
+      return NULL;
+    if (*p == '\\') {
+      escaped = 1;
+      if (*++p == '\0')
+        return NULL;
+    }
+    p++;
+  }
+  if (s != NULL) {
+    s->p       = start;
+    s->len     = p - start;
+    s->escaped = escaped;
+  }
+  return p + 1;
+}
+
+static const char *stream_number(const char *p, long *n)
+{
+  char *end;
+  long v = strtol(p, &end, 10);
+
+  if (end == p)
+    return NULL;
+  if (*end == '.' || *end == 'e' || *end == 'E')
+    v = (long)strtod(p, &end);
+  if (n != NULL)
+    *n = v;
+  return end;
+}
+
+static const char *stream_skip(const char *p, int depth)
+{
+  if (depth > STREAM_MAX_DEPTH)
+    return NULL;
+
+  switch (*p) {
+  case '"':
+    return stream_string(p, NULL);
+  case '{':
+  case '[': {
+    char close = *p == '{' ? '}' : ']';
+    p          = stream_ws(p + 1);
+    if (*p == close)
+      return p + 1;
+    for (;;) {
+      if (close == '}') {
+        if (*p != '"' || (p = stream_string(p, NULL)) == NULL)
+          return NULL;
+        p = stream_ws(p);
+        if (*p != ':')
+          return NULL;
+        p = stream_ws(p + 1);
+      }
+      if ((p = stream_skip(p, depth + 1)) == NULL)
+        return NULL;
+      p = stream_ws(p);
+      if (*p == close)
+        return p + 1;
+      if (*p != ',')
+        return NULL;
+      p = stream_ws(p + 1);
+    }
+  }
+  case 't':
+    return strncmp(p, "true", 4) == 0 ? p + 4 : NULL;
+  case 'f':
+    return strncmp(p, "false", 5) == 0 ? p + 5 : NULL;
+  case 'n':
+    return strncmp(p, "null", 4) == 0 ? p + 4 : NULL;
+  default:
+    return stream_number(p, NULL);
+  }
+}
+
+static int stream_hex(const char *p, unsigned int *v)
+{
+  int i;
+  *v = 0;
+  for (i = 0; i < 4; i++) {
+    if (!isxdigit((unsigned char)p[i]))
+      return 0;
+    *v = (*v << 4) | (isdigit((unsigned char)p[i]) ? p[i] - '0' : (tolower((unsigned char)p[i]) - 'a' + 10));
+  }
+  return 1;
+}
+
+// Decode s into dst and terminate it. Returns the decoded length, or -1 when
+// it does not fit in dstlen bytes or holds an escaped NUL, which no C string
+// can carry. With a NULL dst nothing is written and only the length is
+// computed.
+int stns_json_copy(const stns_json_span_t *s, char *dst, size_t dstlen)
+{
+  const char *p   = s->p;
+  const char *end = s->p + s->len;
+  size_t n        = 0;
+  unsigned int cp, lo;
+  int width;
+
+  if (!s->escaped) {
+    if (dst == NULL)
+      return s->len;
+    if (s->len + 1 > dstlen)
+      return -1;
+    memcpy(dst, s->p, s->len);
+    dst[s->len] = '\0';
+    return s->len;
+  }
+
+  while (p < end) {
+    if (*p != '\\') {
+      if (dst != NULL) {
+        if (n + 1 >= dstlen)
+          return -1;
+        dst[n] = *p;
+      }
+      n++;
+      p++;
+      continue;
+    }
+    p++;
+    switch (*p) {
+    case 'b':
+      cp = '\b';
+      break;
+    case 'f':
+      cp = '\f';
+      break;
+    case 'n':
+      cp = '\n';
+      break;
+    case 'r':
+      cp = '\r';
+      break;
+    case 't':
+      cp = '\t';
+      break;
+    case 'u':
+      // a malformed escape is kept as a plain 'u'
+      if (end - p < 5 || !stream_hex(p + 1, &cp)) {
+        cp = 'u';
+        break;
+      }
+      p += 4;
+      if (cp == 0)
+        return -1;
+      if (cp >= 0xd800 && cp < 0xdc00 && end - p >= 7 && p[1] == '\\' && p[2] == 'u' && stream_hex(p + 3, &lo) &&
+          lo >= 0xdc00 && lo < 0xe000) {
+        cp = 0x10000 + ((cp - 0xd800) << 10) + (lo - 0xdc00);
+        p += 6;
+      }
+      break;
+    default:
+      cp = (unsigned char)*p;
+      break;
+    }
+    p++;
+
+    // encode the code point as UTF-8
+    width = cp < 0x80 ? 1 : cp < 0x800 ? 2 : cp < 0x10000 ? 3 : 4;
+    if (dst == NULL) {
+      n += width;
+      continue;
+    }
+    if (n + width >= dstlen)
+      return -1;
+    if (cp < 0x80) {
+      dst[n++] = cp;
+    } else if (cp < 0x800) {
+      dst[n++] = 0xc0 | (cp >> 6);
+      dst[n++] = 0x80 | (cp & 0x3f);
+    } else if (cp < 0x10000) {
+      dst[n++] = 0xe0 | (cp >> 12);
+      dst[n++] = 0x80 | ((cp >> 6) & 0x3f);
+      dst[n++] = 0x80 | (cp & 0x3f);
+    } else {
+      dst[n++] = 0xf0 | (cp >> 18);
+      dst[n++] = 0x80 | ((cp >> 12) & 0x3f);
+      dst[n++] = 0x80 | ((cp >> 6) & 0x3f);
+      dst[n++] = 0x80 | (cp & 0x3f);
+    }
+  }
+  if (dst != NULL)
+    dst[n] = '\0';
+  return n;
+}
+
+// The number of bytes stns_json_emit needs for s, or for def in its place.
+size_t stns_json_size(const stns_json_span_t *s, const char *def)
+{
+  if (s != NULL && s->p != NULL && s->len > 0)
+    return stns_json_copy(s, NULL, 0) + 1;
+  return strlen(def) + 1;
+}
+
+int stns_json_eq(const stns_json_span_t *s, const char *str)
+{
+  char b[MAXBUF];
+
+  if (s->p == NULL)
+    return 0;
+  if (!s->escaped)
+    return strlen(str) == s->len && memcmp(s->p, str, s->len) == 0;
+  return stns_json_copy(s, b, sizeof(b)) >= 0 && strcmp(b, str) == 0;
+}
+
+// Decode s, or def when it is NULL, missing or empty, at the start of *buf and
+// move *buf past it. Returns NULL when the remaining buffer is too small.
+char *stns_json_emit(const stns_json_span_t *s, const char *def, char **buf, size_t *buflen)
+{
+  char *start = *buf;
+  int len;
+
+  if (s != NULL && s->p != NULL && s->len > 0) {
+    if ((len = stns_json_copy(s, start, *buflen)) < 0)
+      return NULL;
+  } else {
+    len = strlen(def);
+    if (len + 1 > *buflen)
+      return NULL;
+    memcpy(start, def, len + 1);
+  }
+  *buf += len + 1;
+  *buflen -= len + 1;
+  return start;
+}
+
+void stns_json_init(stns_json_t *j, const char *data)
+{
+  memset(j, 0, sizeof(*j));
+  j->p = data;
+}
+
+void stns_json_filter_name(stns_json_t *j, const char *name)
+{
+  j->filter = STNS_JSON_FILTER_NAME;
+  j->name   = name;
+}
+
+void stns_json_filter_id(stns_json_t *j, long id)
+{
+  j->filter = STNS_JSON_FILTER_ID;
+  j->id     = id;
+}
+
+#define STREAM_KEY_IS(k, lit) ((k).len == sizeof(lit) - 1 && memcmp((k).p, lit, sizeof(lit) - 1) == 0)
+
+// Whether s decodes to a string with an escaped NUL in it, which would end it
+// early and could make "root\u0000x" equal "root".
+static int stream_has_nul(const stns_json_span_t *s)
+{
+  return s->escaped && stns_json_copy(s, NULL, 0) < 0;
+}
+
+// Read one object into e. Once the filtered field is known not to match, the
+// remaining values are skipped without being looked at. An object with an
+// escaped NUL in one of its strings never matches.
+static const char *stream_entry(stns_json_t *j, const char *p, stns_json_entry_t *e, int *matched)
+{
+  stns_json_span_t k;
+  stns_json_span_t *field;
+  int mismatch = 0;
+  int found    = 0;
+  int invalid  = 0;
+
+  memset(e, 0, sizeof(*e));
+  p = stream_ws(p + 1);
+  if (*p == '}')
+    goto end;
+
+  for (;;) {
+    if (*p != '"' || (p = stream_string(p, &k)) == NULL)
+      return NULL;
+    p = stream_ws(p);
+    if (*p != ':')
+      return NULL;
+    p = stream_ws(p + 1);
+
+    field = NULL;
+    if (mismatch || k.escaped) {
+      p = stream_skip(p, 1);
+    } else if (STREAM_KEY_IS(k, "id") || STREAM_KEY_IS(k, "group_id")) {
+      long *n = k.len == 2 ? &e->id : &e->group_id;
+      if (*p == '-' || isdigit((unsigned char)*p)) {
+        p = stream_number(p, n);
+        if (k.len == 2 && j->filter == STNS_JSON_FILTER_ID) {
+          found    = *n == j->id;
+          mismatch = !found;
+        }
+      } else {
+        p = stream_skip(p, 1);
+      }
+    } else if (STREAM_KEY_IS(k, "users")) {
+      const char *start = p;
+      if ((p = stream_skip(p, 1)) != NULL && *start == '[') {
+        e->users.p   = start;
+        e->users.len = p - start;
+      }
+    } else {
+      if (STREAM_KEY_IS(k, "name"))
+        field = &e->name;
+      else if (STREAM_KEY_IS(k, "password"))
+        field = &e->password;
+      else if (STREAM_KEY_IS(k, "gecos"))
+        field = &e->gecos;
+      else if (STREAM_KEY_IS(k, "directory"))
+        field = &e->directory;
+      else if (STREAM_KEY_IS(k, "shell"))
+        field = &e->shell;
+
+      if (field != NULL && *p == '"') {
+        p = stream_string(p, field);
+        invalid |= p != NULL && stream_has_nul(field);
+        if (field == &e->name && j->filter == STNS_JSON_FILTER_NAME) {
+          found    = stns_json_eq(field, j->name);
+          mismatch = !found;
+        }
+      } else {
+        p = stream_skip(p, 1);
+      }
+    }
+    if (p == NULL)
+      return NULL;
+
+    p = stream_ws(p);
+    if (*p == '}')
+      break;
+    if (*p != ',')
+      return NULL;
+    p = stream_ws(p + 1);
+  }
+end:
+  *matched = !invalid && (j->filter == STNS_JSON_FILTER_NONE || found);
+  return p + 1;
+}
+
+// Advance to the next object of the top level array that passes the filter.
+// Returns 1 when e holds one, 0 at the end of the array and -1 on malformed
+// input. A document that is valid but not an array has no entries.
+int stns_json_next_entry(stns_json_t *j, stns_json_entry_t *e)
+{
+  const char *p = j->p;
+  int matched;
+
+  if (j->state == STNS_JSON_DONE)
+    return 0;
+  if (j->state == STNS_JSON_START) {
+    p = stream_ws(p);
+    if (*p != '[') {
+      if ((p = stream_skip(p, 0)) == NULL || *stream_ws(p) != '\0')
+        return -1;
+      j->state = STNS_JSON_DONE;
+      return 0;
+    }
+    p = stream_ws(p + 1);
+    if (*p == ']') {
+      j->state = STNS_JSON_DONE;
+      return 0;
+    }
+    j->state = STNS_JSON_ARRAY;
+  }
+
+  for (;;) {
+    matched = 0;
+    p       = *p == '{' ? stream_entry(j, p, e, &matched) : stream_skip(p, 1);
+    if (p == NULL)
+      return -1;
+
+    p = stream_ws(p);
+    if (*p == ']') {
+      j->state = STNS_JSON_DONE;
+    } else if (*p == ',') {
+      p = stream_ws(p + 1);
+    } else {
+      return -1;
+    }
+    j->p = p + (j->state == STNS_JSON_DONE);
+
+    if (matched)
+      return 1;
+    if (j->state == STNS_JSON_DONE)
+      return 0;
+  }
+}
+
+// Walk the string elements of an array span such as the members of a group.
+// *cursor starts at NULL; elements that are not strings, or that hold an
+// escaped NUL, are skipped.
+int stns_json_array_next(const stns_json_span_t *array, const char **cursor, stns_json_span_t *s)
+{
+  const char *p = *cursor == NULL ? stream_ws(array->p + 1) : *cursor;
+
+  while (*p != ']') {
+    const char *start = p;
+    if (*p == '"')
+      p = stream_string(p, s);
+    else
+      p = stream_skip(p, 1);
+    if (p == NULL)
+      return -1;
+    p = stream_ws(p);
+    if (*p == ',')
+      p = stream_ws(p + 1);
+    else if (*p != ']')
+      return -1;
+    if (*start == '"' && !stream_has_nul(s)) {
+      *cursor = p;
+      return 1;
+    }
+  }
+  *cursor = p;
+  return 0;
+}
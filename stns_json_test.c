@@ -0,0 +1,110 @@
+#include "stns_test.h"
+
+Test(stns_json_next_entry, filter)
+{
+  char *data = "[{\"id\": 1, \"name\": \"user1\", \"keys\": [\"a\", {\"b\": [1, 2]}]}, 3, null,"
+               " {\"name\": \"user2\", \"id\": 2, \"group_id\": -5, \"shell\": null}]";
+  stns_json_t j;
+  stns_json_entry_t e;
+
+  stns_json_init(&j, data);
+  cr_assert_eq(stns_json_next_entry(&j, &e), 1);
+  cr_assert_eq(e.id, 1);
+  cr_assert(stns_json_eq(&e.name, "user1"));
+  cr_assert_eq(stns_json_next_entry(&j, &e), 1);
+  cr_assert_eq(e.id, 2);
+  cr_assert_eq(e.group_id, -5);
+  cr_assert_null(e.shell.p);
+  cr_assert_eq(stns_json_next_entry(&j, &e), 0);
+
+  stns_json_init(&j, data);
+  stns_json_filter_name(&j, "user2");
+  cr_assert_eq(stns_json_next_entry(&j, &e), 1);
+  cr_assert_eq(e.id, 2);
+  cr_assert_eq(stns_json_next_entry(&j, &e), 0);
+
+  stns_json_init(&j, data);
+  stns_json_filter_id(&j, 1);
+  cr_assert_eq(stns_json_next_entry(&j, &e), 1);
+  cr_assert(stns_json_eq(&e.name, "user1"));
+
+  stns_json_init(&j, data);
+  stns_json_filter_id(&j, 3);
+  cr_assert_eq(stns_json_next_entry(&j, &e), 0);
+}
+
+Test(stns_json_next_entry, not_array)
+{
+  stns_json_t j;
+  stns_json_entry_t e;
+
+  stns_json_init(&j, "{\"id\": 1}");
+  cr_assert_eq(stns_json_next_entry(&j, &e), 0);
+  stns_json_init(&j, "[]");
+  cr_assert_eq(stns_json_next_entry(&j, &e), 0);
+  stns_json_init(&j, "");
+  cr_assert_eq(stns_json_next_entry(&j, &e), -1);
+  stns_json_init(&j, "[{\"id\": 1, \"name\": \"user1\"");
+  cr_assert_eq(stns_json_next_entry(&j, &e), -1);
+  stns_json_init(&j, "[{\"id\": 1} {\"id\": 2}]");
+  cr_assert_eq(stns_json_next_entry(&j, &e), -1);
+}
+
+Test(stns_json_copy, escape)
+{
+  stns_json_t j;
+  stns_json_entry_t e;
+  char buf[MAXBUF];
+
+  stns_json_init(&j, "[{\"name\": \"a\\\"b\\\\c\\/d\\n\\u00e9\\ud83d\\ude00\"}]");
+  cr_assert_eq(stns_json_next_entry(&j, &e), 1);
+  cr_assert_eq(stns_json_copy(&e.name, buf, sizeof(buf)), 14);
+  cr_assert_str_eq(buf, "a\"b\\c/d\n\xc3\xa9\xf0\x9f\x98\x80");
+  cr_assert(stns_json_eq(&e.name, "a\"b\\c/d\n\xc3\xa9\xf0\x9f\x98\x80"));
+  cr_assert_eq(stns_json_copy(&e.name, buf, 14), -1);
+}
+
+Test(stns_json_next_entry, escaped_nul)
+{
+  char *data = "[{\"name\": \"root\\u0000x\", \"id\": 1}, {\"name\": \"user2\", \"id\": 2,"
+               " \"users\": [\"a\\u0000\", \"b\"]}]";
+  stns_json_t j;
+  stns_json_entry_t e;
+  stns_json_span_t s;
+  const char *cursor = NULL;
+
+  // an entry whose name would be cut short is never returned
+  stns_json_init(&j, data);
+  cr_assert_eq(stns_json_next_entry(&j, &e), 1);
+  cr_assert_eq(e.id, 2);
+  stns_json_init(&j, data);
+  stns_json_filter_name(&j, "root");
+  cr_assert_eq(stns_json_next_entry(&j, &e), 0);
+  stns_json_init(&j, data);
+  stns_json_filter_id(&j, 1);
+  cr_assert_eq(stns_json_next_entry(&j, &e), 0);
+
+  // nor is such a member
+  stns_json_init(&j, data);
+  stns_json_filter_id(&j, 2);
+  cr_assert_eq(stns_json_next_entry(&j, &e), 1);
+  cr_assert_eq(stns_json_array_next(&e.users, &cursor, &s), 1);
+  cr_assert(stns_json_eq(&s, "b"));
+  cr_assert_eq(stns_json_array_next(&e.users, &cursor, &s), 0);
+}
+
+Test(stns_json_array_next, ok)
+{
+  stns_json_t j;
+  stns_json_entry_t e;
+  stns_json_span_t s;
+  const char *cursor = NULL;
+
+  stns_json_init(&j, "[{\"users\": [\"foo\", 1, \"bar\"]}]");
+  cr_assert_eq(stns_json_next_entry(&j, &e), 1);
+  cr_assert_eq(stns_json_array_next(&e.users, &cursor, &s), 1);
+  cr_assert(stns_json_eq(&s, "foo"));
+  cr_assert_eq(stns_json_array_next(&e.users, &cursor, &s), 1);
+  cr_assert(stns_json_eq(&s, "bar"));
+  cr_assert_eq(stns_json_array_next(&e.users, &cursor, &s), 0);
+}
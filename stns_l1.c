@@ -0,0 +1,200 @@
+#include "stns.h"
+
+// An in-process cache in front of the memory-mapped one: records decoded
+// earlier in this process, keyed as the disk records are, in a bounded
+// open-addressed table. A hit is a hash, a probe and one copy into the
+// caller's buffer, with no allocation and no system call. Names that the API
+// did not know are kept too, so repeated lookups of them stay in the process.
+//
+// The table is split into STNS_L1_LOCKS stripes, each a contiguous run of
+// slots with a lock of its own, and a key is probed only within the stripe its
+// hash picks, so threads looking up different names rarely share a lock.
+//
+// Every entry keeps the expiry it was stored with, at most cache_ttl or
+// negative_cache_ttl, and the table is emptied whenever another configuration
+// is loaded.
+
+typedef struct stns_l1_entry_t stns_l1_entry_t;
+struct stns_l1_entry_t {
+  uint64_t hash;
+  time_t expires_at;
+  // the key, its terminating NUL, then the record; size is 0 for a name the
+  // API did not know
+  char *data;
+  size_t key_len;
+  size_t size;
+};
+
+typedef struct stns_l1_stripe_t stns_l1_stripe_t;
+struct stns_l1_stripe_t {
+  pthread_rwlock_t lock;
+} __attribute__((aligned(64)));
+
+static stns_l1_stripe_t l1_stripes[STNS_L1_LOCKS];
+static pthread_once_t l1_once    = PTHREAD_ONCE_INIT;
+static stns_l1_entry_t *l1_table = NULL;
+// slots per stripe, minus one
+static size_t l1_mask = 0;
+
+static void l1_lock_all(void)
+{
+  int i;
+
+  for (i = 0; i < STNS_L1_LOCKS; i++)
+    pthread_rwlock_wrlock(&l1_stripes[i].lock);
+}
+
+static void l1_unlock_all(void)
+{
+  int i;
+
+  for (i = STNS_L1_LOCKS - 1; i >= 0; i--)
+    pthread_rwlock_unlock(&l1_stripes[i].lock);
+}
+
+static void l1_init(void)
+{
+  int i;
+
+  for (i = 0; i < STNS_L1_LOCKS; i++)
+    pthread_rwlock_init(&l1_stripes[i].lock, NULL);
+  pthread_atfork(l1_lock_all, l1_unlock_all, l1_unlock_all);
+}
+
+static void l1_free(stns_l1_entry_t *table, size_t mask)
+{
+  size_t i;
+
+  if (table == NULL)
+    return;
+  for (i = 0; i < (mask + 1) * STNS_L1_LOCKS; i++)
+    free(table[i].data);
+  free(table);
+}
+
+// Empty the table and size it for entries records; 0 turns it off.
+void stns_l1_reset(int entries)
+{
+  stns_l1_entry_t *table = NULL, *old;
+  size_t per_stripe = STNS_L1_PROBE, old_mask;
+
+  pthread_once(&l1_once, l1_init);
+  if (entries > 0) {
+    while (per_stripe * STNS_L1_LOCKS < (size_t)entries)
+      per_stripe *= 2;
+    table = (stns_l1_entry_t *)calloc(per_stripe * STNS_L1_LOCKS, sizeof(stns_l1_entry_t));
+  }
+
+  l1_lock_all();
+  old      = l1_table;
+  old_mask = l1_mask;
+  l1_mask  = table != NULL ? per_stripe - 1 : 0;
+  // read without a lock to skip a table that is turned off
+  __atomic_store_n(&l1_table, table, __ATOMIC_RELEASE);
+  l1_unlock_all();
+  l1_free(old, old_mask);
+}
+
+static pthread_rwlock_t *l1_stripe_lock(uint64_t hash)
+{
+  return &l1_stripes[(hash >> 32) % STNS_L1_LOCKS].lock;
+}
+
+// Called with the lock of the stripe of hash held.
+static stns_l1_entry_t *l1_slot(uint64_t hash, size_t i)
+{
+  size_t stripe = (hash >> 32) % STNS_L1_LOCKS;
+  return &l1_table[stripe * (l1_mask + 1) + ((hash + i) & l1_mask)];
+}
+
+// Called with the lock of the stripe of hash held.
+static stns_l1_entry_t *l1_find(const char *key, size_t key_len, uint64_t hash)
+{
+  stns_l1_entry_t *e;
+  size_t i;
+
+  for (i = 0; i < STNS_L1_PROBE; i++) {
+    e = l1_slot(hash, i);
+    if (e->data != NULL && e->hash == hash && e->key_len == key_len && memcmp(e->data, key, key_len) == 0)
+      return e;
+  }
+  return NULL;
+}
+
+// Returns 1 when a live record was copied into buf, 2 when key is known not to
+// exist, 0 on a miss and -1 when buflen is too small to hold the record.
+int stns_l1_get(const char *key, stns_record_t *rec, char *buf, size_t buflen)
+{
+  size_t key_len = strlen(key);
+  uint64_t hash;
+  pthread_rwlock_t *lock;
+  stns_l1_entry_t *e;
+  int ret = 0;
+
+  if (__atomic_load_n(&l1_table, __ATOMIC_ACQUIRE) == NULL)
+    return 0;
+  hash = stns_hash64(key, key_len);
+  lock = l1_stripe_lock(hash);
+
+  pthread_rwlock_rdlock(lock);
+  if (l1_table != NULL && (e = l1_find(key, key_len, hash)) != NULL && e->expires_at > time(NULL)) {
+    if (e->size == 0) {
+      ret = 2;
+    } else {
+      memcpy(rec, e->data + key_len + 1, sizeof(stns_record_t));
+      ret = rec->size > buflen ? -1 : 1;
+      if (ret == 1)
+        memcpy(buf, e->data + key_len + 1, rec->size);
+    }
+  }
+  pthread_rwlock_unlock(lock);
+  return ret;
+}
+
+// The record of size bytes at record, or a name the API did not know when size
+// is 0. In a full probe sequence the entry that expires first is replaced.
+void stns_l1_put(const char *key, const char *record, size_t size, time_t expires_at)
+{
+  size_t key_len = strlen(key);
+  uint64_t hash  = stns_hash64(key, key_len);
+  time_t now     = time(NULL);
+  pthread_rwlock_t *lock;
+  stns_l1_entry_t *e, *victim = NULL;
+  char *data, *old = NULL;
+  size_t i;
+
+  if (__atomic_load_n(&l1_table, __ATOMIC_ACQUIRE) == NULL || expires_at <= now)
+    return;
+  if ((data = (char *)malloc(key_len + 1 + size)) == NULL)
+    return;
+  memcpy(data, key, key_len + 1);
+  if (size > 0)
+    memcpy(data + key_len + 1, record, size);
+
+  lock = l1_stripe_lock(hash);
+  pthread_rwlock_wrlock(lock);
+  if (l1_table == NULL) {
+    pthread_rwlock_unlock(lock);
+    free(data);
+    return;
+  }
+  if ((victim = l1_find(key, key_len, hash)) == NULL) {
+    for (i = 0; i < STNS_L1_PROBE; i++) {
+      e = l1_slot(hash, i);
+      if (e->data == NULL || e->expires_at <= now) {
+        victim = e;
+        break;
+      }
+      if (victim == NULL || e->expires_at < victim->expires_at)
+        victim = e;
+    }
+  }
+  old                = victim->data;
+  victim->hash       = hash;
+  victim->expires_at = expires_at;
+  victim->data       = data;
+  victim->key_len    = key_len;
+  victim->size       = size;
+  pthread_rwlock_unlock(lock);
+  free(old);
+}
@@ -0,0 +1,83 @@
+#include "stns_test.h"
+
+Test(stns_l1, put_and_get)
+{
+  stns_record_t rec;
+  char *strings[] = {"user1", "x"};
+  char record[MAXBUF], buf[MAXBUF];
+  size_t size = stns_record_encode(record, 1000, 2000, strings, 2);
+
+  stns_l1_reset(16);
+  cr_assert_eq(stns_l1_get("passwd:users?name=user1", &rec, buf, sizeof(buf)), 0);
+  stns_l1_put("passwd:users?name=user1", record, size, time(NULL) + 10);
+
+  cr_assert_eq(stns_l1_get("passwd:users?name=user1", &rec, buf, sizeof(buf)), 1);
+  cr_assert_eq(rec.id, 1000);
+  cr_assert_eq(rec.group_id, 2000);
+  cr_assert_str_eq(stns_record_string(buf, 0), "user1");
+  cr_assert_eq(stns_l1_get("passwd:users?name=user1", &rec, buf, 8), -1);
+  cr_assert_eq(stns_l1_get("passwd:users?name=user2", &rec, buf, sizeof(buf)), 0);
+
+  // nothing that has already expired is stored, and a reset forgets everything
+  stns_l1_put("passwd:users?name=user1", record, size, time(NULL) - 1);
+  cr_assert_eq(stns_l1_get("passwd:users?name=user1", &rec, buf, sizeof(buf)), 1);
+  stns_l1_put("group:groups?name=group1", NULL, 0, time(NULL) + 10);
+  cr_assert_eq(stns_l1_get("group:groups?name=group1", &rec, buf, sizeof(buf)), 2);
+  stns_l1_reset(16);
+  cr_assert_eq(stns_l1_get("passwd:users?name=user1", &rec, buf, sizeof(buf)), 0);
+  cr_assert_eq(stns_l1_get("group:groups?name=group1", &rec, buf, sizeof(buf)), 0);
+
+  stns_l1_reset(0);
+  stns_l1_put("passwd:users?name=user1", record, size, time(NULL) + 10);
+  cr_assert_eq(stns_l1_get("passwd:users?name=user1", &rec, buf, sizeof(buf)), 0);
+}
+
+Test(stns_l1, bounded)
+{
+  stns_record_t rec;
+  char *strings[] = {"user", "x"};
+  char record[MAXBUF], buf[MAXBUF], key[MAXBUF];
+  size_t size = stns_record_encode(record, 1, 1, strings, 2);
+  int i, hits = 0;
+
+  // the smallest table has a probe sequence in every stripe
+  stns_l1_reset(1);
+  for (i = 0; i < 1000; i++) {
+    snprintf(key, sizeof(key), "passwd:users?id=%d", i);
+    stns_l1_put(key, record, size, time(NULL) + 10 + i);
+  }
+  for (i = 0; i < 1000; i++) {
+    snprintf(key, sizeof(key), "passwd:users?id=%d", i);
+    hits += stns_l1_get(key, &rec, buf, sizeof(buf)) == 1;
+  }
+  cr_assert_leq(hits, STNS_L1_PROBE * STNS_L1_LOCKS);
+  cr_assert_geq(hits, STNS_L1_PROBE);
+  // the entries that expire last are the ones kept
+  cr_assert_eq(stns_l1_get("passwd:users?id=999", &rec, buf, sizeof(buf)), 1);
+  stns_l1_reset(0);
+}
+
+Test(stns_l1, in_front_of_records)
+{
+  stns_conf_t c = cache_test_conf("/tmp/stns_l1_test");
+  stns_record_t rec;
+  char *strings[] = {"group1", "x"};
+  char buf[MAXBUF], path[MAXBUF];
+
+  c.cache_ttl          = 10;
+  c.negative_cache_ttl = 10;
+  snprintf(path, sizeof(path), "%s/%d/%s", c.cache_dir, geteuid(), STNS_CACHE_FILE);
+
+  stns_l1_reset(16);
+  cr_assert_eq(stns_record_put(&c, "group:groups?name=group1", 1, 0, strings, 2), 1);
+  // the cache file is gone, the process still has the record
+  unlink(path);
+  cr_assert_eq(stns_record_get(&c, "group:groups?name=group1", &rec, buf, sizeof(buf)), 1);
+  cr_assert_str_eq(stns_record_string(buf, 0), "group1");
+
+  cr_assert_eq(stns_record_notfound(&c, "group:groups?name=group2"), 0);
+  stns_record_put_notfound(&c, "group:groups?name=group2");
+  cr_assert_eq(stns_record_notfound(&c, "group:groups?name=group2"), 1);
+  cr_assert_eq(stns_record_get(&c, "group:groups?name=group2", &rec, buf, sizeof(buf)), 0);
+  stns_l1_reset(0);
+}
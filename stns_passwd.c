@@ -1,33 +1,123 @@
 #include "stns.h"
 
-static JSON_Value *entries  = NULL;
-static int entry_idx        = 0;
-pthread_mutex_t pwent_mutex = PTHREAD_MUTEX_INITIALIZER;
-
-#define PASSWD_ENSURE(entry)                                                                                           \
-  int id            = (int)json_value_get_number(json_object_get_value(entry, "id"));                                  \
-  int group_id      = (int)json_value_get_number(json_object_get_value(entry, "group_id"));                            \
-  const char *name  = json_value_get_string(json_object_get_value(entry, "name"));                                     \
-  const char *gecos = json_value_get_string(json_object_get_value(entry, "gecos"));                                    \
-  const char *dir   = json_value_get_string(json_object_get_value(entry, "directory"));                                \
-  const char *shell = json_value_get_string(json_object_get_value(entry, "shell"));                                    \
-  char passwd[]     = "x";                                                                                             \
-  rbuf->pw_uid      = c->uid_shift + id;                                                                               \
-  rbuf->pw_gid      = c->gid_shift + group_id;                                                                         \
-                                                                                                                       \
-  STNS_SET_DEFAULT_VALUE(sh, shell, "/bin/bash");                                                                      \
-  char b[MAXBUF];                                                                                                      \
-  snprintf(b, sizeof(b), "/home/%s", name);                                                                            \
-  STNS_SET_DEFAULT_VALUE(d, dir, b);                                                                                   \
-  SET_ATTRBUTE(pw, name, name)                                                                                         \
-  SET_ATTRBUTE(pw, passwd, passwd)                                                                                     \
-  SET_ATTRBUTE(pw, gecos, gecos)                                                                                       \
-  SET_ATTRBUTE(pw, dir, dir)                                                                                           \
-  SET_ATTRBUTE(pw, shell, shell)
-
-STNS_ENSURE_BY(name, const char *, user_name, string, name, (strcmp(current, user_name) == 0), passwd, PASSWD)
-STNS_ENSURE_BY(uid, uid_t, uid, number, id, current + (c->uid_shift) == uid, passwd, PASSWD)
-
-STNS_GET_SINGLE_VALUE_METHOD(getpwnam_r, const char *name, "users?name=%s", name, passwd, , )
-STNS_GET_SINGLE_VALUE_METHOD(getpwuid_r, uid_t uid, "users?id=%d", uid, passwd, USER_ID_QUERY_AVAILABLE, -(c.uid_shift))
-STNS_SET_ENTRIES(pw, PASSWD, passwd, users)
+static stns_enumeration_t enumeration = STNS_ENUMERATION_INITIALIZER;
+
+// Stored under both the name and the id, whichever key the lookup used, so
+// that getpwnam followed by getpwuid makes a single request.
+static void passwd_record_put(stns_conf_t *c, const char *key, struct passwd *rbuf)
+{
+  char *strings[] = {rbuf->pw_name, rbuf->pw_passwd, rbuf->pw_gecos, rbuf->pw_dir, rbuf->pw_shell};
+  char by[MAXBUF + 16];
+
+  snprintf(by, sizeof(by), "passwd:users?name=%s", rbuf->pw_name);
+  stns_record_put(c, by, rbuf->pw_uid - c->uid_shift, rbuf->pw_gid - c->gid_shift, strings, 5);
+  snprintf(by, sizeof(by), "passwd:users?id=%d", rbuf->pw_uid - c->uid_shift);
+  stns_record_put(c, by, rbuf->pw_uid - c->uid_shift, rbuf->pw_gid - c->gid_shift, strings, 5);
+}
+
+static int passwd_snapshot_add(stns_snapshot_t *s, struct passwd *rbuf)
+{
+  char *strings[] = {rbuf->pw_name, rbuf->pw_passwd, rbuf->pw_gecos, rbuf->pw_dir, rbuf->pw_shell};
+  return stns_snapshot_add(s, rbuf->pw_uid, rbuf->pw_gid, strings, 5);
+}
+
+// Point rbuf into the record at the start of buf.
+static enum nss_status passwd_record_decode(stns_record_t *rec, struct passwd *rbuf, char *buf, size_t buflen,
+                                            int *errnop)
+{
+  if (rec->nstrings != 5)
+    return NSS_STATUS_NOTFOUND;
+
+  rbuf->pw_uid    = rec->id;
+  rbuf->pw_gid    = rec->group_id;
+  rbuf->pw_name   = stns_record_string(buf, 0);
+  rbuf->pw_passwd = stns_record_string(buf, 1);
+  rbuf->pw_gecos  = stns_record_string(buf, 2);
+  rbuf->pw_dir    = stns_record_string(buf, 3);
+  rbuf->pw_shell  = stns_record_string(buf, 4);
+  return NSS_STATUS_SUCCESS;
+}
+
+static enum nss_status passwd_record_get(stns_conf_t *c, const char *key, struct passwd *rbuf, char *buf,
+                                         size_t buflen, int *errnop)
+{
+  stns_record_t rec;
+  enum nss_status result;
+
+  switch (stns_record_get(c, key, &rec, buf, buflen)) {
+  case -1:
+    *errnop = ERANGE;
+    return NSS_STATUS_TRYAGAIN;
+  case 0:
+    return NSS_STATUS_NOTFOUND;
+  }
+
+  result = passwd_record_decode(&rec, rbuf, buf, buflen, errnop);
+  rbuf->pw_uid += c->uid_shift;
+  rbuf->pw_gid += c->gid_shift;
+  return result;
+}
+
+// The exact number of bytes passwd_ensure writes for e.
+static size_t passwd_size(stns_json_entry_t *e, char *buf)
+{
+  size_t dir = e->directory.p != NULL && e->directory.len > 0 ? stns_json_size(&e->directory, "")
+                                                              : strlen("/home/") + stns_json_size(&e->name, "");
+  return stns_json_size(&e->name, "") + 2 + stns_json_size(&e->gecos, "") + dir +
+         stns_json_size(&e->shell, "/bin/bash");
+}
+
+static enum nss_status passwd_ensure(stns_conf_t *c, stns_json_entry_t *e, struct passwd *rbuf, char *buf,
+                                     size_t buflen, int *errnop)
+{
+  int len;
+
+  if (buflen < passwd_size(e, buf))
+    goto erange;
+
+  rbuf->pw_uid = c->uid_shift + e->id;
+  rbuf->pw_gid = c->gid_shift + e->group_id;
+  if ((rbuf->pw_name = stns_json_emit(&e->name, "", &buf, &buflen)) == NULL ||
+      (rbuf->pw_passwd = stns_json_emit(NULL, "x", &buf, &buflen)) == NULL ||
+      (rbuf->pw_gecos = stns_json_emit(&e->gecos, "", &buf, &buflen)) == NULL)
+    goto erange;
+
+  if (e->directory.p != NULL && e->directory.len > 0) {
+    if ((rbuf->pw_dir = stns_json_emit(&e->directory, "", &buf, &buflen)) == NULL)
+      goto erange;
+  } else {
+    len = snprintf(buf, buflen, "/home/%s", rbuf->pw_name);
+    if (len < 0 || len >= buflen)
+      goto erange;
+    rbuf->pw_dir = buf;
+    buf += len + 1;
+    buflen -= len + 1;
+  }
+
+  if ((rbuf->pw_shell = stns_json_emit(&e->shell, "/bin/bash", &buf, &buflen)) == NULL)
+    goto erange;
+  return NSS_STATUS_SUCCESS;
+erange:
+  *errnop = ERANGE;
+  return NSS_STATUS_TRYAGAIN;
+}
+
+static void passwd_relocate(struct passwd *rbuf, char *from, char *to)
+{
+  STNS_RELOCATE(rbuf->pw_name, from, to);
+  STNS_RELOCATE(rbuf->pw_passwd, from, to);
+  STNS_RELOCATE(rbuf->pw_gecos, from, to);
+  STNS_RELOCATE(rbuf->pw_dir, from, to);
+  STNS_RELOCATE(rbuf->pw_shell, from, to);
+}
+
+STNS_MEMO(passwd)
+STNS_SNAPSHOT_LOOKUP(passwd, users)
+STNS_ENSURE_BY(name, const char *, user_name, name, user_name, passwd)
+STNS_ENSURE_BY(uid, uid_t, uid, id, (long)uid - c->uid_shift, passwd)
+
+STNS_GET_SINGLE_VALUE_METHOD(getpwnam_r, const char *name, "users?name=%s", name, passwd, USER_NAME_QUERY_AVAILABLE,
+                             )
+STNS_GET_SINGLE_VALUE_METHOD(getpwuid_r, uid_t uid, "users?id=%d", uid, passwd, USER_ID_QUERY_AVAILABLE,
+                             -(c->uid_shift))
+STNS_SET_ENTRIES(pw, passwd, users)
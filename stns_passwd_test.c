@@ -126,15 +126,17 @@ Test(inner_nss_stns_setpwent, ok)
   stns_conf_t c;
   stns_response_t r;
 
-  c.uid_shift = 0;
-  c.gid_shift = 0;
+  c.uid_shift              = 0;
+  c.gid_shift              = 0;
+  c.cache                  = 0;
+  c.cache_snapshot_lookups = 0;
   readfile(f, &json);
-  code = inner_nss_stns_setpwent(json, &c);
+  code = inner_nss_stns_setpwent(json, &c, 0, time(NULL) + 10);
   cr_assert_eq(code, NSS_STATUS_SUCCESS);
 
   char *n = malloc(1);
   strcpy(n, "");
-  code = inner_nss_stns_setpwent(n, &c);
+  code = inner_nss_stns_setpwent(n, &c, 0, time(NULL) + 10);
   cr_assert_eq(code, NSS_STATUS_UNAVAIL);
   _nss_stns_endpwent();
 }
@@ -150,13 +152,15 @@ Test(inner_nss_stns_getpwent_r, ok)
   stns_conf_t c;
   stns_response_t r;
 
-  c.uid_shift = 0;
-  c.gid_shift = 0;
+  c.uid_shift              = 0;
+  c.gid_shift              = 0;
+  c.cache                  = 0;
+  c.cache_snapshot_lookups = 0;
   readfile(f, &json);
-  code = inner_nss_stns_setpwent(json, &c);
+  code = inner_nss_stns_setpwent(json, &c, 0, time(NULL) + 10);
   cr_assert_eq(code, NSS_STATUS_SUCCESS);
 
-  code = inner_nss_stns_getpwent_r(&c, &pwd, buffer, MAXBUF, &errnop);
+  code = inner_nss_stns_getpwent_r(&pwd, buffer, MAXBUF, &errnop);
   cr_assert_eq(code, NSS_STATUS_SUCCESS);
   cr_assert_str_eq(pwd.pw_name, "user1");
   cr_assert_eq(pwd.pw_uid, 1);
@@ -166,7 +170,7 @@ Test(inner_nss_stns_getpwent_r, ok)
   cr_assert_str_eq(pwd.pw_shell, "/bin/sh");
   cr_assert_str_eq(pwd.pw_dir, "/home/admin/user1");
 
-  code = inner_nss_stns_getpwent_r(&c, &pwd, buffer, MAXBUF, &errnop);
+  code = inner_nss_stns_getpwent_r(&pwd, buffer, MAXBUF, &errnop);
   cr_assert_eq(code, NSS_STATUS_SUCCESS);
   cr_assert_str_eq(pwd.pw_name, "user2");
   cr_assert_eq(pwd.pw_uid, 2);
@@ -176,7 +180,54 @@ Test(inner_nss_stns_getpwent_r, ok)
   cr_assert_str_eq(pwd.pw_shell, "/bin/bash");
   cr_assert_str_eq(pwd.pw_dir, "/home/user2");
 
-  code = inner_nss_stns_getpwent_r(&c, &pwd, buffer, MAXBUF, &errnop);
+  code = inner_nss_stns_getpwent_r(&pwd, buffer, MAXBUF, &errnop);
   cr_assert_eq(code, NSS_STATUS_NOTFOUND);
   _nss_stns_endpwent();
 }
+
+Test(inner_nss_stns_setpwent, seeds_records)
+{
+  char *f = "test/example1.json";
+  char *json;
+  stns_conf_t c = cache_test_conf("/tmp/stns_seeds_records_test");
+  stns_record_t rec;
+  char buffer[MAXBUF];
+
+  c.cache                  = 1;
+  c.cache_ttl              = 10;
+  c.cache_snapshot_lookups = 0;
+  c.uid_shift              = 0;
+  c.gid_shift              = 0;
+
+  readfile(f, &json);
+  cr_assert_eq(inner_nss_stns_setpwent(json, &c, 0, time(NULL) + 10), NSS_STATUS_SUCCESS);
+  _nss_stns_endpwent();
+
+  // every entry can be looked up by name and by id without a request
+  cr_assert_eq(stns_record_get(&c, "passwd:users?name=user2", &rec, buffer, sizeof(buffer)), 1);
+  cr_assert_eq(rec.id, 2);
+  cr_assert_eq(stns_record_get(&c, "passwd:users?id=1", &rec, buffer, sizeof(buffer)), 1);
+  cr_assert_str_eq(stns_record_string(buffer, 0), "user1");
+}
+
+Test(inner_nss_stns_setpwent, stale_body_seeds_nothing)
+{
+  char *f = "test/example1.json";
+  char *json;
+  stns_conf_t c = cache_test_conf("/tmp/stns_stale_body_seeds_nothing_test");
+  stns_record_t rec;
+  char buffer[MAXBUF];
+
+  c.cache                  = 1;
+  c.cache_ttl              = 10;
+  c.cache_snapshot_lookups = 1;
+  c.uid_shift              = 0;
+  c.gid_shift              = 0;
+
+  // a body served past its expiry is enumerated but not cached again
+  readfile(f, &json);
+  cr_assert_eq(inner_nss_stns_setpwent(json, &c, 1, 0), NSS_STATUS_SUCCESS);
+  _nss_stns_endpwent();
+  cr_assert_eq(stns_record_get(&c, "passwd:users?name=user2", &rec, buffer, sizeof(buffer)), 0);
+  cr_assert_eq(stns_record_get(&c, "passwd:users?id=1", &rec, buffer, sizeof(buffer)), 0);
+}
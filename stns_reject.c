@@ -0,0 +1,173 @@
+#include "stns.h"
+
+// Names and ids configured under [reject] that can never be in STNS, such as
+// the local system accounts that fall through files. They are compiled once
+// when the configuration is loaded: the ids into sorted, merged ranges that a
+// lookup bisects and the names into a trie that a lookup walks once, so that
+// a rejected query is answered without a cache lookup or a request.
+//
+// A name pattern is either a name, which matches only itself, or a prefix
+// followed by '*', which matches every name that starts with it.
+
+static int range_cmp(const void *a, const void *b)
+{
+  const stns_reject_range_t *x = (const stns_reject_range_t *)a;
+  const stns_reject_range_t *y = (const stns_reject_range_t *)b;
+
+  if (x->low != y->low)
+    return x->low < y->low ? -1 : 1;
+  return x->high < y->high ? -1 : x->high > y->high;
+}
+
+int stns_reject_add_range(stns_reject_t *r, long low, long high)
+{
+  stns_reject_range_t *grown;
+
+  if (low < 0 || low > high || (unsigned long)high > UINT32_MAX)
+    return -1;
+  grown = (stns_reject_range_t *)realloc(r->ranges, sizeof(stns_reject_range_t) * (r->nranges + 1));
+  if (grown == NULL)
+    return -1;
+  r->ranges                  = grown;
+  r->ranges[r->nranges].low  = low;
+  r->ranges[r->nranges].high = high;
+  r->nranges++;
+  return 0;
+}
+
+// An id such as "65534" or a range such as "0-999", both ends included.
+int stns_reject_add_ids(stns_reject_t *r, const char *spec)
+{
+  char *end;
+  long low, high;
+
+  errno = 0;
+  low   = strtol(spec, &end, 10);
+  if (end == spec || errno != 0)
+    return -1;
+  high = low;
+  if (*end == '-') {
+    spec = end + 1;
+    high = strtol(spec, &end, 10);
+    if (end == spec || errno != 0)
+      return -1;
+  }
+  if (*end != '\0')
+    return -1;
+  return stns_reject_add_range(r, low, high);
+}
+
+// The child of node labelled ch, created when there is none; -1 when it
+// cannot be.
+static int32_t trie_child(stns_reject_t *r, int32_t node, unsigned char ch)
+{
+  stns_reject_node_t *grown;
+  int32_t i;
+
+  for (i = r->nodes[node].child; i != -1; i = r->nodes[i].sibling)
+    if (r->nodes[i].ch == ch)
+      return i;
+
+  grown = (stns_reject_node_t *)realloc(r->nodes, sizeof(stns_reject_node_t) * (r->nnodes + 1));
+  if (grown == NULL)
+    return -1;
+  r->nodes             = grown;
+  i                    = (int32_t)r->nnodes++;
+  r->nodes[i].ch       = ch;
+  r->nodes[i].match    = 0;
+  r->nodes[i].child    = -1;
+  r->nodes[i].sibling  = r->nodes[node].child;
+  r->nodes[node].child = i;
+  return i;
+}
+
+int stns_reject_add_name(stns_reject_t *r, const char *pattern)
+{
+  size_t len          = strlen(pattern);
+  unsigned char match = STNS_REJECT_EXACT;
+  int32_t node        = 0;
+  size_t i;
+
+  if (len > 0 && pattern[len - 1] == '*') {
+    match = STNS_REJECT_PREFIX;
+    len--;
+  }
+  if ((len == 0 && match == STNS_REJECT_EXACT) || memchr(pattern, '*', len) != NULL)
+    return -1;
+
+  if (r->nodes == NULL) {
+    if ((r->nodes = (stns_reject_node_t *)malloc(sizeof(stns_reject_node_t))) == NULL)
+      return -1;
+    r->nodes[0].ch      = 0;
+    r->nodes[0].match   = 0;
+    r->nodes[0].child   = -1;
+    r->nodes[0].sibling = -1;
+    r->nnodes           = 1;
+  }
+  for (i = 0; i < len; i++)
+    if ((node = trie_child(r, node, (unsigned char)pattern[i])) == -1)
+      return -1;
+  r->nodes[node].match |= match;
+  return 0;
+}
+
+// Sort the ranges and merge the ones that overlap or touch.
+void stns_reject_compile(stns_reject_t *r)
+{
+  size_t i, n = 0;
+
+  if (r->nranges == 0)
+    return;
+  qsort(r->ranges, r->nranges, sizeof(stns_reject_range_t), range_cmp);
+  for (i = 1; i < r->nranges; i++) {
+    if (r->ranges[i].low <= r->ranges[n].high + 1) {
+      if (r->ranges[i].high > r->ranges[n].high)
+        r->ranges[n].high = r->ranges[i].high;
+    } else {
+      r->ranges[++n] = r->ranges[i];
+    }
+  }
+  r->nranges = n + 1;
+}
+
+int stns_reject_id(const stns_reject_t *r, long id)
+{
+  size_t lo = 0, hi = r->nranges, mid;
+
+  while (lo < hi) {
+    mid = lo + (hi - lo) / 2;
+    if (r->ranges[mid].high < id)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  return lo < r->nranges && r->ranges[lo].low <= id;
+}
+
+int stns_reject_name(const stns_reject_t *r, const char *name)
+{
+  const unsigned char *p = (const unsigned char *)name;
+  int32_t node           = 0;
+  int32_t i;
+
+  if (r->nnodes == 0)
+    return 0;
+  for (;; p++) {
+    if (r->nodes[node].match & STNS_REJECT_PREFIX)
+      return 1;
+    if (*p == '\0')
+      return (r->nodes[node].match & STNS_REJECT_EXACT) != 0;
+    for (i = r->nodes[node].child; i != -1 && r->nodes[i].ch != *p; i = r->nodes[i].sibling)
+      ;
+    if (i == -1)
+      return 0;
+    node = i;
+  }
+}
+
+void stns_reject_free(stns_reject_t *r)
+{
+  free(r->ranges);
+  free(r->nodes);
+  memset(r, 0, sizeof(stns_reject_t));
+}
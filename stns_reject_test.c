@@ -0,0 +1,63 @@
+#include "stns_test.h"
+
+Test(stns_reject, ids)
+{
+  stns_reject_t r;
+
+  memset(&r, 0, sizeof(r));
+  cr_assert_eq(stns_reject_id(&r, 0), 0);
+
+  cr_assert_eq(stns_reject_add_ids(&r, "65534"), 0);
+  cr_assert_eq(stns_reject_add_ids(&r, "500-999"), 0);
+  cr_assert_eq(stns_reject_add_ids(&r, "0-499"), 0);
+  cr_assert_eq(stns_reject_add_ids(&r, "100-200"), 0);
+  cr_assert_eq(stns_reject_add_ids(&r, "999-"), -1);
+  cr_assert_eq(stns_reject_add_ids(&r, "10-5"), -1);
+  cr_assert_eq(stns_reject_add_ids(&r, "root"), -1);
+  cr_assert_eq(stns_reject_add_ids(&r, "-1"), -1);
+  stns_reject_compile(&r);
+
+  // ranges that overlap or touch are merged
+  cr_assert_eq(r.nranges, 2);
+  cr_assert_eq(stns_reject_id(&r, 0), 1);
+  cr_assert_eq(stns_reject_id(&r, 999), 1);
+  cr_assert_eq(stns_reject_id(&r, 1000), 0);
+  cr_assert_eq(stns_reject_id(&r, 65533), 0);
+  cr_assert_eq(stns_reject_id(&r, 65534), 1);
+  cr_assert_eq(stns_reject_id(&r, 65535), 0);
+  stns_reject_free(&r);
+  cr_assert_eq(stns_reject_id(&r, 0), 0);
+}
+
+Test(stns_reject, names)
+{
+  stns_reject_t r;
+
+  memset(&r, 0, sizeof(r));
+  cr_assert_eq(stns_reject_name(&r, "root"), 0);
+
+  cr_assert_eq(stns_reject_add_name(&r, "root"), 0);
+  cr_assert_eq(stns_reject_add_name(&r, "systemd-*"), 0);
+  cr_assert_eq(stns_reject_add_name(&r, "_*"), 0);
+  cr_assert_eq(stns_reject_add_name(&r, "sys"), 0);
+  cr_assert_eq(stns_reject_add_name(&r, "sy*d"), -1);
+  cr_assert_eq(stns_reject_add_name(&r, ""), -1);
+  stns_reject_compile(&r);
+
+  cr_assert_eq(stns_reject_name(&r, "root"), 1);
+  cr_assert_eq(stns_reject_name(&r, "roo"), 0);
+  cr_assert_eq(stns_reject_name(&r, "rooter"), 0);
+  cr_assert_eq(stns_reject_name(&r, "systemd-network"), 1);
+  cr_assert_eq(stns_reject_name(&r, "systemd-"), 1);
+  cr_assert_eq(stns_reject_name(&r, "systemd"), 0);
+  cr_assert_eq(stns_reject_name(&r, "sys"), 1);
+  cr_assert_eq(stns_reject_name(&r, "_apt"), 1);
+  cr_assert_eq(stns_reject_name(&r, "user1"), 0);
+  cr_assert_eq(stns_reject_name(&r, ""), 0);
+  stns_reject_free(&r);
+
+  cr_assert_eq(stns_reject_add_name(&r, "*"), 0);
+  cr_assert_eq(stns_reject_name(&r, ""), 1);
+  cr_assert_eq(stns_reject_name(&r, "user1"), 1);
+  stns_reject_free(&r);
+}
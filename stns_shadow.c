@@ -1,25 +1,93 @@
 #include "stns.h"
 
-static JSON_Value *entries  = NULL;
-static int entry_idx        = 0;
-pthread_mutex_t spent_mutex = PTHREAD_MUTEX_INITIALIZER;
-
-#define SHADOW_ENSURE(entry)                                                                                           \
-  const char *name     = json_value_get_string(json_object_get_value(entry, "name"));                                  \
-  const char *password = json_value_get_string(json_object_get_value(entry, "password"));                              \
-  SET_ATTRBUTE(sp, name, namp);                                                                                        \
-  STNS_SET_DEFAULT_VALUE(pw, password, "!!");                                                                          \
-  SET_ATTRBUTE(sp, password, pwdp);                                                                                    \
-  rbuf->sp_lstchg = -1;                                                                                                \
-  rbuf->sp_min    = -1;                                                                                                \
-  rbuf->sp_max    = -1;                                                                                                \
-  rbuf->sp_warn   = -1;                                                                                                \
-  rbuf->sp_inact  = -1;                                                                                                \
-  rbuf->sp_expire = -1;                                                                                                \
+static stns_enumeration_t enumeration = STNS_ENUMERATION_INITIALIZER;
+
+// A shadow entry carries no uid, so only a lookup by uid (key) can store
+// under it; every entry is stored under its name.
+static void spwd_record_put(stns_conf_t *c, const char *key, struct spwd *rbuf)
+{
+  char *strings[] = {rbuf->sp_namp, rbuf->sp_pwdp};
+  char by[MAXBUF + 16];
+
+  snprintf(by, sizeof(by), "spwd:users?name=%s", rbuf->sp_namp);
+  stns_record_put(c, by, 0, 0, strings, 2);
+  if (key != NULL && strcmp(key, by) != 0)
+    stns_record_put(c, key, 0, 0, strings, 2);
+}
+
+static int spwd_snapshot_add(stns_snapshot_t *s, struct spwd *rbuf)
+{
+  char *strings[] = {rbuf->sp_namp, rbuf->sp_pwdp};
+  return stns_snapshot_add(s, 0, 0, strings, 2);
+}
+
+static enum nss_status spwd_record_decode(stns_record_t *rec, struct spwd *rbuf, char *buf, size_t buflen,
+                                          int *errnop)
+{
+  if (rec->nstrings != 2)
+    return NSS_STATUS_NOTFOUND;
+
+  rbuf->sp_namp   = stns_record_string(buf, 0);
+  rbuf->sp_pwdp   = stns_record_string(buf, 1);
+  rbuf->sp_lstchg = -1;
+  rbuf->sp_min    = -1;
+  rbuf->sp_max    = -1;
+  rbuf->sp_warn   = -1;
+  rbuf->sp_inact  = -1;
+  rbuf->sp_expire = -1;
   rbuf->sp_flag   = ~0ul;
+  return NSS_STATUS_SUCCESS;
+}
+
+static enum nss_status spwd_record_get(stns_conf_t *c, const char *key, struct spwd *rbuf, char *buf, size_t buflen,
+                                       int *errnop)
+{
+  stns_record_t rec;
+
+  switch (stns_record_get(c, key, &rec, buf, buflen)) {
+  case -1:
+    *errnop = ERANGE;
+    return NSS_STATUS_TRYAGAIN;
+  case 0:
+    return NSS_STATUS_NOTFOUND;
+  }
+  return spwd_record_decode(&rec, rbuf, buf, buflen, errnop);
+}
+
+static size_t spwd_size(stns_json_entry_t *e, char *buf)
+{
+  return stns_json_size(&e->name, "") + stns_json_size(&e->password, "!!");
+}
+
+static enum nss_status spwd_ensure(stns_conf_t *c, stns_json_entry_t *e, struct spwd *rbuf, char *buf, size_t buflen,
+                                   int *errnop)
+{
+  if (buflen < spwd_size(e, buf) || (rbuf->sp_namp = stns_json_emit(&e->name, "", &buf, &buflen)) == NULL ||
+      (rbuf->sp_pwdp = stns_json_emit(&e->password, "!!", &buf, &buflen)) == NULL) {
+    *errnop = ERANGE;
+    return NSS_STATUS_TRYAGAIN;
+  }
+  rbuf->sp_lstchg = -1;
+  rbuf->sp_min    = -1;
+  rbuf->sp_max    = -1;
+  rbuf->sp_warn   = -1;
+  rbuf->sp_inact  = -1;
+  rbuf->sp_expire = -1;
+  rbuf->sp_flag   = ~0ul;
+  return NSS_STATUS_SUCCESS;
+}
+
+static void spwd_relocate(struct spwd *rbuf, char *from, char *to)
+{
+  STNS_RELOCATE(rbuf->sp_namp, from, to);
+  STNS_RELOCATE(rbuf->sp_pwdp, from, to);
+}
 
-STNS_ENSURE_BY(name, const char *, user_name, string, name, (strcmp(current, user_name) == 0), spwd, SHADOW)
-STNS_ENSURE_BY(uid, uid_t, uid, number, id, current + (c->uid_shift) == uid, spwd, SHADOW)
-STNS_GET_SINGLE_VALUE_METHOD(getspnam_r, const char *name, "users?name=%s", name, spwd, , )
-STNS_GET_SINGLE_VALUE_METHOD(getspuid_r, uid_t uid, "users?id=%d", uid, spwd, , -(c.uid_shift))
-STNS_SET_ENTRIES(sp, SHADOW, spwd, users)
+STNS_MEMO(spwd)
+STNS_SNAPSHOT_LOOKUP(spwd, users)
+STNS_ENSURE_BY(name, const char *, user_name, name, user_name, spwd)
+STNS_ENSURE_BY(uid, uid_t, uid, id, (long)uid - c->uid_shift, spwd)
+STNS_GET_SINGLE_VALUE_METHOD(getspnam_r, const char *name, "users?name=%s", name, spwd, USER_NAME_QUERY_AVAILABLE,
+                             )
+STNS_GET_SINGLE_VALUE_METHOD(getspuid_r, uid_t uid, "users?id=%d", uid, spwd, USER_ID_REJECTED, -(c->uid_shift))
+STNS_SET_ENTRIES(sp, spwd, users)
@@ -76,15 +76,17 @@ Test(inner_nss_stns_setspent, ok)
   stns_conf_t c;
   stns_response_t r;
 
-  c.uid_shift = 0;
-  c.gid_shift = 0;
+  c.uid_shift              = 0;
+  c.gid_shift              = 0;
+  c.cache                  = 0;
+  c.cache_snapshot_lookups = 0;
   readfile(f, &json);
-  code = inner_nss_stns_setspent(json, &c);
+  code = inner_nss_stns_setspent(json, &c, 0, time(NULL) + 10);
   cr_assert_eq(code, NSS_STATUS_SUCCESS);
 
   char *n = malloc(1);
   strcpy(n, "");
-  code = inner_nss_stns_setspent(n, &c);
+  code = inner_nss_stns_setspent(n, &c, 0, time(NULL) + 10);
   cr_assert_eq(code, NSS_STATUS_UNAVAIL);
   _nss_stns_endspent();
 }
@@ -100,11 +102,13 @@ Test(inner_nss_stns_getspent_r, ok)
   stns_conf_t c;
   stns_response_t r;
 
+  c.cache                  = 0;
+  c.cache_snapshot_lookups = 0;
   readfile(f, &json);
-  code = inner_nss_stns_setspent(json, &c);
+  code = inner_nss_stns_setspent(json, &c, 0, time(NULL) + 10);
   cr_assert_eq(code, NSS_STATUS_SUCCESS);
 
-  code = inner_nss_stns_getspent_r(&c, &spbuf, buffer, MAXBUF, &errnop);
+  code = inner_nss_stns_getspent_r(&spbuf, buffer, MAXBUF, &errnop);
   cr_assert_eq(code, NSS_STATUS_SUCCESS);
   cr_assert_str_eq(spbuf.sp_namp, "user1");
   cr_assert_str_eq(spbuf.sp_pwdp, "test");
@@ -116,7 +120,7 @@ Test(inner_nss_stns_getspent_r, ok)
   cr_assert_eq(spbuf.sp_expire, -1);
   cr_assert_eq(spbuf.sp_flag, ~0ul);
 
-  code = inner_nss_stns_getspent_r(&c, &spbuf, buffer, MAXBUF, &errnop);
+  code = inner_nss_stns_getspent_r(&spbuf, buffer, MAXBUF, &errnop);
   cr_assert_eq(code, NSS_STATUS_SUCCESS);
   cr_assert_str_eq(spbuf.sp_namp, "user2");
   cr_assert_str_eq(spbuf.sp_pwdp, "!!");
@@ -128,7 +132,7 @@ Test(inner_nss_stns_getspent_r, ok)
   cr_assert_eq(spbuf.sp_expire, -1);
   cr_assert_eq(spbuf.sp_flag, ~0ul);
 
-  code = inner_nss_stns_getspent_r(&c, &spbuf, buffer, MAXBUF, &errnop);
+  code = inner_nss_stns_getspent_r(&spbuf, buffer, MAXBUF, &errnop);
   cr_assert_eq(code, NSS_STATUS_NOTFOUND);
   _nss_stns_endspent();
 }
@@ -0,0 +1,389 @@
+#include "stns.h"
+
+// The result of setpwent, setgrent and setspent: every entry of the response
+// decoded once into a record (see stns_record_encode) and packed back to back
+// in a single pool, with the offset of each record kept in an index. The
+// response and its decoder state are dropped as soon as it is built, and an
+// enumeration step is a lookup in the index and one copy.
+//
+// A snapshot is immutable once built and reference counted. Every thread
+// enumerates it through its own cursor, so concurrent enumerations neither
+// share a position nor take a lock per entry.
+//
+// With cache_snapshot_lookups a snapshot is also indexed by name and by id,
+// two arrays sorted by the hash of the name and by the id, and kept after the
+// enumeration ends so that getpwnam and the like are answered from it, a
+// name missing from it included, until it expires.
+
+#define SNAPSHOT_INITIAL_POOL 4096
+#define SNAPSHOT_INITIAL_INDEX 64
+
+typedef struct stns_snapshot_key_t stns_snapshot_key_t;
+struct stns_snapshot_key_t {
+  uint64_t key;
+  size_t record;
+};
+
+struct stns_snapshot_t {
+  int refcount;
+  char *pool;
+  size_t size;
+  size_t capacity;
+  size_t *index;
+  size_t count;
+  size_t index_capacity;
+  // the hash of the name and the id of record i are names[i] and ids[i]
+  // until stns_snapshot_index sorts them
+  stns_snapshot_key_t *names;
+  stns_snapshot_key_t *ids;
+  size_t key_capacity;
+  int indexed;
+  time_t expires_at;
+};
+
+static pthread_mutex_t enumeration_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t enumeration_once   = PTHREAD_ONCE_INIT;
+
+// The new snapshot holds one reference, owned by the caller.
+stns_snapshot_t *stns_snapshot_new(void)
+{
+  stns_snapshot_t *s = (stns_snapshot_t *)calloc(1, sizeof(stns_snapshot_t));
+  if (s != NULL)
+    s->refcount = 1;
+  return s;
+}
+
+void stns_snapshot_ref(stns_snapshot_t *s)
+{
+  __atomic_add_fetch(&s->refcount, 1, __ATOMIC_RELAXED);
+}
+
+void stns_snapshot_release(stns_snapshot_t *s)
+{
+  if (s == NULL || __atomic_sub_fetch(&s->refcount, 1, __ATOMIC_ACQ_REL) > 0)
+    return;
+  free(s->pool);
+  free(s->index);
+  free(s->names);
+  free(s->ids);
+  free(s);
+}
+
+static int snapshot_reserve(void **p, size_t *capacity, size_t need, size_t initial, size_t unit)
+{
+  size_t n = *capacity == 0 ? initial : *capacity;
+  void *grown;
+
+  if (need <= *capacity)
+    return 1;
+  while (n < need)
+    n *= 2;
+  if ((grown = realloc(*p, n * unit)) == NULL)
+    return 0;
+  *p        = grown;
+  *capacity = n;
+  return 1;
+}
+
+// Returns 1 when the record was appended and 0 when memory ran out.
+int stns_snapshot_add(stns_snapshot_t *s, int id, int group_id, char **strings, uint32_t n)
+{
+  size_t size = stns_record_encode(NULL, id, group_id, strings, n);
+
+  if (!snapshot_reserve((void **)&s->pool, &s->capacity, s->size + size, SNAPSHOT_INITIAL_POOL, 1) ||
+      !snapshot_reserve((void **)&s->index, &s->index_capacity, s->count + 1, SNAPSHOT_INITIAL_INDEX, sizeof(size_t)))
+    return 0;
+
+  s->index[s->count++] = s->size;
+  s->size += stns_record_encode(s->pool + s->size, id, group_id, strings, n);
+  return 1;
+}
+
+// Key the last record added by its name, string 0 of every record, and by
+// id, the one the API reported before any shift. Returns 0 when memory ran
+// out.
+int stns_snapshot_index_add(stns_snapshot_t *s, long id)
+{
+  size_t i        = s->count - 1;
+  size_t capacity = s->key_capacity;
+  char *name;
+
+  if (!snapshot_reserve((void **)&s->names, &capacity, s->count, SNAPSHOT_INITIAL_INDEX, sizeof(stns_snapshot_key_t)))
+    return 0;
+  if (!snapshot_reserve((void **)&s->ids, &s->key_capacity, s->count, SNAPSHOT_INITIAL_INDEX,
+                        sizeof(stns_snapshot_key_t)))
+    return 0;
+
+  name               = stns_record_string(s->pool + s->index[i], 0);
+  s->names[i].key    = stns_hash64(name, strlen(name));
+  s->names[i].record = i;
+  s->ids[i].key      = (uint64_t)id;
+  s->ids[i].record   = i;
+  return 1;
+}
+
+static int snapshot_key_compare(const void *a, const void *b)
+{
+  uint64_t x = ((const stns_snapshot_key_t *)a)->key;
+  uint64_t y = ((const stns_snapshot_key_t *)b)->key;
+  return x < y ? -1 : x > y;
+}
+
+// Sort the keys of a snapshot that every record was keyed in.
+void stns_snapshot_index(stns_snapshot_t *s)
+{
+  if (s->names == NULL && s->count > 0)
+    return;
+  qsort(s->names, s->count, sizeof(stns_snapshot_key_t), snapshot_key_compare);
+  qsort(s->ids, s->count, sizeof(stns_snapshot_key_t), snapshot_key_compare);
+  s->indexed = 1;
+}
+
+int stns_snapshot_indexed(const stns_snapshot_t *s)
+{
+  return s->indexed;
+}
+
+// The first of the keys equal to key, or count when there is none.
+static size_t snapshot_key_find(const stns_snapshot_key_t *keys, size_t count, uint64_t key)
+{
+  size_t lo = 0, hi = count, mid;
+
+  while (lo < hi) {
+    mid = lo + (hi - lo) / 2;
+    if (keys[mid].key < key)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  return lo < count && keys[lo].key == key ? lo : count;
+}
+
+// Look url, as in "users?name=user1" or "groups?id=1", up in the index.
+// Returns 1 when the record was copied into buf, 0 when the snapshot has no
+// such entry, -1 when buflen is too small and -2 when the snapshot cannot
+// answer for url.
+int stns_snapshot_find(const stns_snapshot_t *s, const char *url, stns_record_t *rec, char *buf, size_t buflen)
+{
+  const char *query = strchr(url, '?');
+  const char *name;
+  char *end;
+  uint64_t key;
+  long id;
+  size_t i;
+
+  if (!s->indexed || query == NULL)
+    return -2;
+
+  if (strncmp(query + 1, "name=", 5) == 0) {
+    name = query + 6;
+    key  = stns_hash64(name, strlen(name));
+    for (i = snapshot_key_find(s->names, s->count, key); i < s->count && s->names[i].key == key; i++) {
+      if (strcmp(stns_record_string(s->pool + s->index[s->names[i].record], 0), name) == 0)
+        return stns_snapshot_get(s, s->names[i].record, rec, buf, buflen);
+    }
+    return 0;
+  }
+  if (strncmp(query + 1, "id=", 3) == 0) {
+    id = strtol(query + 4, &end, 10);
+    if (*end != '\0')
+      return -2;
+    i = snapshot_key_find(s->ids, s->count, (uint64_t)id);
+    return i < s->count ? stns_snapshot_get(s, s->ids[i].record, rec, buf, buflen) : 0;
+  }
+  return -2;
+}
+
+// Give back what the doubling reserved beyond the last record.
+void stns_snapshot_shrink(stns_snapshot_t *s)
+{
+  char *pool;
+  size_t *index;
+  stns_snapshot_key_t *keys;
+
+  if (s->size > 0 && s->size < s->capacity && (pool = (char *)realloc(s->pool, s->size)) != NULL) {
+    s->pool     = pool;
+    s->capacity = s->size;
+  }
+  if (s->count > 0 && s->count < s->index_capacity &&
+      (index = (size_t *)realloc(s->index, s->count * sizeof(size_t))) != NULL) {
+    s->index          = index;
+    s->index_capacity = s->count;
+  }
+  // no key is added after this, so the two arrays need not stay the same size
+  if (s->names != NULL && s->count > 0 && s->count < s->key_capacity) {
+    if ((keys = (stns_snapshot_key_t *)realloc(s->names, s->count * sizeof(stns_snapshot_key_t))) != NULL)
+      s->names = keys;
+    if ((keys = (stns_snapshot_key_t *)realloc(s->ids, s->count * sizeof(stns_snapshot_key_t))) != NULL)
+      s->ids = keys;
+    s->key_capacity = s->count;
+  }
+}
+
+size_t stns_snapshot_count(const stns_snapshot_t *s)
+{
+  return s->count;
+}
+
+// Returns 1 when record i was copied into buf, 0 when there is no such record
+// and -1 when buflen is too small to hold it.
+int stns_snapshot_get(const stns_snapshot_t *s, size_t i, stns_record_t *rec, char *buf, size_t buflen)
+{
+  if (i >= s->count)
+    return 0;
+  memcpy(rec, s->pool + s->index[i], sizeof(stns_record_t));
+  if (rec->size > buflen)
+    return -1;
+  memcpy(buf, s->pool + s->index[i], rec->size);
+  return 1;
+}
+
+static void enumeration_atfork_prepare(void)
+{
+  pthread_mutex_lock(&enumeration_mutex);
+}
+
+static void enumeration_atfork_release(void)
+{
+  pthread_mutex_unlock(&enumeration_mutex);
+}
+
+static void enumeration_init(void)
+{
+  pthread_atfork(enumeration_atfork_prepare, enumeration_atfork_release, enumeration_atfork_release);
+}
+
+static void cursor_free(void *p)
+{
+  stns_cursor_t *cur = (stns_cursor_t *)p;
+  stns_snapshot_release(cur->snapshot);
+  free(cur);
+}
+
+static stns_cursor_t *enumeration_thread_cursor(stns_enumeration_t *e, int create)
+{
+  stns_cursor_t *cur;
+
+  pthread_once(&enumeration_once, enumeration_init);
+  if (!__atomic_load_n(&e->key_created, __ATOMIC_ACQUIRE)) {
+    pthread_mutex_lock(&enumeration_mutex);
+    if (!e->key_created && pthread_key_create(&e->key, cursor_free) == 0)
+      __atomic_store_n(&e->key_created, 1, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&enumeration_mutex);
+    if (!e->key_created)
+      return NULL;
+  }
+
+  cur = (stns_cursor_t *)pthread_getspecific(e->key);
+  if (cur == NULL && create) {
+    cur = (stns_cursor_t *)calloc(1, sizeof(stns_cursor_t));
+    if (cur != NULL && pthread_setspecific(e->key, cur) != 0) {
+      free(cur);
+      cur = NULL;
+    }
+  }
+  return cur;
+}
+
+// Make s the snapshot later enumerations start from and rewind the calling
+// thread's cursor onto it. Takes over the caller's reference to s.
+stns_cursor_t *stns_enumeration_start(stns_enumeration_t *e, stns_snapshot_t *s)
+{
+  stns_cursor_t *cur = enumeration_thread_cursor(e, 1);
+  stns_snapshot_t *old;
+
+  if (cur == NULL) {
+    stns_snapshot_release(s);
+    return NULL;
+  }
+
+  stns_snapshot_ref(s);
+  pthread_mutex_lock(&enumeration_mutex);
+  old        = e->current;
+  e->current = s;
+  pthread_mutex_unlock(&enumeration_mutex);
+  stns_snapshot_release(old);
+
+  stns_snapshot_release(cur->snapshot);
+  cur->snapshot = s;
+  cur->idx      = 0;
+  return cur;
+}
+
+// The calling thread's cursor. A thread that has not started an enumeration
+// of its own begins one over the current snapshot; NULL when there is none.
+stns_cursor_t *stns_enumeration_cursor(stns_enumeration_t *e)
+{
+  stns_cursor_t *cur = enumeration_thread_cursor(e, 1);
+
+  if (cur == NULL || cur->snapshot != NULL)
+    return cur;
+
+  pthread_mutex_lock(&enumeration_mutex);
+  if ((cur->snapshot = e->current) != NULL)
+    stns_snapshot_ref(cur->snapshot);
+  pthread_mutex_unlock(&enumeration_mutex);
+  cur->idx = 0;
+  return cur->snapshot != NULL ? cur : NULL;
+}
+
+// Drop the calling thread's cursor, and the current snapshot too when that
+// cursor was the last one on it, so memory is given back as endpwent always
+// did while threads in the middle of an enumeration keep theirs.
+void stns_enumeration_end(stns_enumeration_t *e)
+{
+  stns_cursor_t *cur   = enumeration_thread_cursor(e, 0);
+  stns_snapshot_t *old = NULL;
+
+  if (cur == NULL || cur->snapshot == NULL)
+    return;
+
+  pthread_mutex_lock(&enumeration_mutex);
+  // one reference is held by current and one by this cursor
+  if (e->current == cur->snapshot && __atomic_load_n(&cur->snapshot->refcount, __ATOMIC_ACQUIRE) <= 2) {
+    old        = e->current;
+    e->current = NULL;
+  }
+  pthread_mutex_unlock(&enumeration_mutex);
+  stns_snapshot_release(old);
+
+  stns_snapshot_release(cur->snapshot);
+  cur->snapshot = NULL;
+  cur->idx      = 0;
+}
+
+// Answer lookups from s, an indexed snapshot, until expires_at, in place of
+// the snapshot that answered them so far. Takes a reference of its own.
+void stns_enumeration_index(stns_enumeration_t *e, stns_snapshot_t *s, time_t expires_at)
+{
+  stns_snapshot_t *old;
+
+  pthread_once(&enumeration_once, enumeration_init);
+  stns_snapshot_ref(s);
+  pthread_mutex_lock(&enumeration_mutex);
+  s->expires_at = expires_at;
+  old           = e->indexed;
+  e->indexed    = s;
+  pthread_mutex_unlock(&enumeration_mutex);
+  stns_snapshot_release(old);
+}
+
+// The snapshot lookups are answered from, with a reference for the caller,
+// or NULL when there is none or it has expired.
+stns_snapshot_t *stns_enumeration_indexed(stns_enumeration_t *e)
+{
+  stns_snapshot_t *s, *expired = NULL;
+  time_t now = time(NULL);
+
+  pthread_once(&enumeration_once, enumeration_init);
+  pthread_mutex_lock(&enumeration_mutex);
+  if ((s = e->indexed) != NULL && s->expires_at <= now) {
+    expired    = s;
+    e->indexed = s = NULL;
+  } else if (s != NULL) {
+    stns_snapshot_ref(s);
+  }
+  pthread_mutex_unlock(&enumeration_mutex);
+  stns_snapshot_release(expired);
+  return s;
+}
@@ -0,0 +1,125 @@
+#include "stns_test.h"
+
+Test(stns_snapshot, add_and_get)
+{
+  stns_snapshot_t *s = stns_snapshot_new();
+  stns_record_t rec;
+  char *user1[]  = {"user1", "x", "", "/home/user1", "/bin/bash"};
+  char *group1[] = {"group1", "x", "user1", "user2"};
+  char buf[MAXBUF];
+
+  cr_assert_eq(stns_snapshot_add(s, 1, 2, user1, 5), 1);
+  cr_assert_eq(stns_snapshot_add(s, 3, 0, group1, 4), 1);
+  stns_snapshot_shrink(s);
+  cr_assert_eq(stns_snapshot_count(s), 2);
+
+  cr_assert_eq(stns_snapshot_get(s, 0, &rec, buf, sizeof(buf)), 1);
+  cr_assert_eq(rec.id, 1);
+  cr_assert_eq(rec.group_id, 2);
+  cr_assert_eq(rec.nstrings, 5);
+  cr_assert_str_eq(stns_record_string(buf, 3), "/home/user1");
+
+  cr_assert_eq(stns_snapshot_get(s, 1, &rec, buf, sizeof(buf)), 1);
+  cr_assert_eq(rec.id, 3);
+  cr_assert_eq(rec.nstrings, 4);
+  cr_assert_str_eq(stns_record_string(buf, 0), "group1");
+  cr_assert_str_eq(stns_record_string(buf, 3), "user2");
+
+  cr_assert_eq(stns_snapshot_get(s, 1, &rec, buf, 8), -1);
+  cr_assert_eq(stns_snapshot_get(s, 2, &rec, buf, sizeof(buf)), 0);
+  stns_snapshot_release(s);
+}
+
+Test(stns_snapshot, find)
+{
+  stns_snapshot_t *s = stns_snapshot_new();
+  stns_record_t rec;
+  char *user1[] = {"user1", "x"};
+  char *user2[] = {"user2", "x"};
+  char buf[MAXBUF];
+
+  cr_assert_eq(stns_snapshot_add(s, 1001, 0, user1, 2), 1);
+  cr_assert_eq(stns_snapshot_index_add(s, 1), 1);
+  cr_assert_eq(stns_snapshot_add(s, 1002, 0, user2, 2), 1);
+  cr_assert_eq(stns_snapshot_index_add(s, 2), 1);
+  stns_snapshot_shrink(s);
+  cr_assert_eq(stns_snapshot_find(s, "users?name=user2", &rec, buf, sizeof(buf)), -2);
+  stns_snapshot_index(s);
+
+  cr_assert_eq(stns_snapshot_find(s, "users?name=user2", &rec, buf, sizeof(buf)), 1);
+  cr_assert_eq(rec.id, 1002);
+  cr_assert_str_eq(stns_record_string(buf, 0), "user2");
+  // ids are the ones of the API, before any shift
+  cr_assert_eq(stns_snapshot_find(s, "users?id=1", &rec, buf, sizeof(buf)), 1);
+  cr_assert_str_eq(stns_record_string(buf, 0), "user1");
+  cr_assert_eq(stns_snapshot_find(s, "users?id=1", &rec, buf, 8), -1);
+
+  // what the snapshot does not have does not exist
+  cr_assert_eq(stns_snapshot_find(s, "users?name=user3", &rec, buf, sizeof(buf)), 0);
+  cr_assert_eq(stns_snapshot_find(s, "users?id=1001", &rec, buf, sizeof(buf)), 0);
+  cr_assert_eq(stns_snapshot_find(s, "users", &rec, buf, sizeof(buf)), -2);
+
+  stns_snapshot_release(s);
+}
+
+static stns_enumeration_t test_enumeration = STNS_ENUMERATION_INITIALIZER;
+
+Test(stns_enumeration, indexed)
+{
+  stns_snapshot_t *s = stns_snapshot_new();
+  char *user1[] = {"user1", "x"};
+
+  stns_snapshot_add(s, 1, 0, user1, 2);
+  stns_snapshot_index_add(s, 1);
+  stns_snapshot_index(s);
+
+  stns_enumeration_index(&test_enumeration, s, time(NULL) + 10);
+  stns_snapshot_release(s);
+  cr_assert_eq(stns_enumeration_indexed(&test_enumeration), s);
+  stns_snapshot_release(s);
+
+  stns_enumeration_index(&test_enumeration, s, time(NULL));
+  cr_assert_eq(stns_enumeration_indexed(&test_enumeration), NULL);
+}
+
+static void *enumerate(void *arg)
+{
+  stns_cursor_t *cur;
+  stns_record_t rec;
+  char buf[MAXBUF];
+  long n = 0;
+
+  while ((cur = stns_enumeration_cursor(&test_enumeration)) != NULL &&
+         stns_snapshot_get(cur->snapshot, cur->idx, &rec, buf, sizeof(buf)) == 1) {
+    cur->idx++;
+    n++;
+  }
+  stns_enumeration_end(&test_enumeration);
+  return (void *)n;
+}
+
+Test(stns_enumeration, cursor_per_thread)
+{
+  stns_snapshot_t *s = stns_snapshot_new();
+  char *strings[]    = {"user", "x"};
+  pthread_t threads[4];
+  void *n;
+  int i;
+
+  for (i = 0; i < 1000; i++)
+    stns_snapshot_add(s, i, i, strings, 2);
+  cr_assert_not_null(stns_enumeration_start(&test_enumeration, s));
+
+  // every thread walks the whole snapshot with its own cursor
+  for (i = 0; i < 4; i++)
+    pthread_create(&threads[i], NULL, enumerate, NULL);
+  for (i = 0; i < 4; i++) {
+    pthread_join(threads[i], &n);
+    cr_assert_eq((long)n, 1000);
+  }
+
+  // the starting thread's own cursor was not moved by the others
+  cr_assert_eq(stns_enumeration_cursor(&test_enumeration)->idx, 0);
+  stns_enumeration_end(&test_enumeration);
+  cr_assert_null(stns_enumeration_cursor(&test_enumeration));
+}
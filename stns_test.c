@@ -1,5 +1,8 @@
 #include "stns.h"
 #include "stns_test.h"
+#include <dirent.h>
+#include <sys/wait.h>
+#include <utime.h>
 
 stns_conf_t test_conf()
 {
@@ -9,6 +12,8 @@ stns_conf_t test_conf()
   c.cache_dir          = "/var/cache/stns";
   c.cached_unix_socket = "/var/run/cache-stnsd.sock";
   c.cache              = 0;
+  c.cache_slots        = STNS_CACHE_SLOTS;
+  c.cache_l1_entries   = STNS_L1_ENTRIES;
   c.user               = NULL;
   c.ssl_verify         = 0;
   c.use_cached         = 0;
@@ -18,10 +23,27 @@ stns_conf_t test_conf()
   c.tls_cert           = NULL;
   c.tls_key            = NULL;
   c.tls_ca             = NULL;
+  c.tls_session_cache  = 0;
   c.http_headers       = NULL;
   c.request_timeout    = 3;
   c.request_retry      = 3;
+  c.request_locktime   = 60;
+  c.request_deadline   = 3000;
   c.auth_token         = NULL;
+
+  c.request_connect_timeout = 0;
+  c.request_backoff         = 100;
+  c.request_backoff_max     = 1000;
+
+  c.cache_stale_ttl              = 0;
+  c.cache_stale_while_revalidate = 0;
+  c.cache_snapshot_lookups       = 0;
+  c.cache_name_filter            = 0;
+
+  c.circuit_breaker_failures = 1;
+  c.circuit_breaker_rate     = 0;
+  c.circuit_breaker_window   = 60;
+  c.circuit_breaker_trip_on  = STNS_BREAKER_TRIP_ALL;
   return c;
 }
 
@@ -59,6 +81,23 @@ void readfile(char *file, char **result)
   fclose(fp);
 }
 
+// A configuration whose cache files live under dir, emptied: every test
+// passes a dir of its own, as criterion runs tests in parallel.
+stns_conf_t cache_test_conf(const char *dir)
+{
+  stns_conf_t c = test_conf();
+  char path[MAXBUF];
+
+  c.cache_dir   = (char *)dir;
+  c.cache_slots = 64;
+  mkdir(c.cache_dir, S_IRWXU);
+  snprintf(path, sizeof(path), "%s/%d/%s", c.cache_dir, geteuid(), STNS_CACHE_FILE);
+  unlink(path);
+  snprintf(path, sizeof(path), "%s/%d/%s", c.cache_dir, geteuid(), STNS_STATE_FILE);
+  unlink(path);
+  return c;
+}
+
 Test(stns_load_config, load_ok)
 {
   char *f = "test/stns.conf";
@@ -80,15 +119,56 @@ Test(stns_load_config, load_ok)
   cr_assert_eq(c.request_timeout, 3);
   cr_assert_eq(c.request_retry, 3);
   cr_assert_eq(c.negative_cache_ttl, 10);
+  cr_assert_eq(c.circuit_breaker_failures, 1);
+  cr_assert_eq(c.circuit_breaker_trip_on, STNS_BREAKER_TRIP_CONNECT);
   cr_assert_str_eq(c.tls_cert, "example_cert");
   cr_assert_str_eq(c.tls_key, "example_key");
   cr_assert_str_eq(c.tls_ca, "ca_cert");
   cr_assert_eq(c.http_headers->size, 1);
   cr_assert_str_eq(c.http_headers->headers[0].key, "X-API-TOKEN");
   cr_assert_str_eq(c.http_headers->headers[0].value, "token");
+  cr_assert_eq(stns_reject_id(&c.reject_user, 65534), 1);
+  cr_assert_eq(stns_reject_id(&c.reject_user, 1000), 0);
+  cr_assert_eq(stns_reject_id(&c.reject_group, 65533), 1);
+  cr_assert_eq(stns_reject_id(&c.reject_group, 65534), 0);
+  cr_assert_eq(stns_reject_name(&c.reject_user, "systemd-network"), 1);
+  cr_assert_eq(stns_reject_name(&c.reject_group, "systemd-network"), 0);
   stns_unload_config(&c);
 }
 
+Test(stns_acquire_config, reload_on_change)
+{
+  char *f = "/tmp/stns_acquire_config_test.conf";
+  FILE *fp;
+  stns_conf_t *c1, *c2, *c3;
+
+  fp = fopen(f, "w");
+  fprintf(fp, "api_endpoint = \"http://localhost:1104/v1\"\nuid_shift = 1\n");
+  fclose(fp);
+
+  c1 = stns_acquire_config(f);
+  c2 = stns_acquire_config(f);
+  cr_assert_not_null(c1);
+  cr_assert_eq(c1, c2);
+  cr_assert_eq(c1->uid_shift, 1);
+
+  fp = fopen(f, "w");
+  fprintf(fp, "api_endpoint = \"http://localhost:1104/v1\"\nuid_shift = 200\n");
+  fclose(fp);
+
+  c3 = stns_acquire_config(f);
+  cr_assert_neq(c1, c3);
+  cr_assert_eq(c3->uid_shift, 200);
+  // the previous snapshot stays valid until released
+  cr_assert_eq(c1->uid_shift, 1);
+
+  stns_release_config(c1);
+  stns_release_config(c2);
+  stns_release_config(c3);
+  cr_assert_null(stns_acquire_config("/tmp/stns_acquire_config_notfound.conf"));
+  unlink(f);
+}
+
 Test(stns_request, http_request)
 {
   char expect_body[1024];
@@ -102,11 +182,11 @@ Test(stns_request, http_request)
 
 Test(stns_request, http_cache)
 {
-  struct stat st;
   stns_conf_t c = test_conf();
-  stns_response_t r;
+  stns_response_t r, cached;
+  time_t expires_at;
   char path[MAXBUF];
-  snprintf(path, sizeof(path), "/var/cache/stns/%d/%s", geteuid(), "get%3Fexample");
+  snprintf(path, sizeof(path), "/var/cache/stns/%d/%s", geteuid(), STNS_CACHE_FILE);
 
   unlink(path);
   c.cache              = 1;
@@ -116,17 +196,20 @@ Test(stns_request, http_cache)
   c.cached_enable      = 0;
 
   mkdir("/var/cache/stns/", S_ISVTX | S_IRWXU | S_IRWXG | S_IRWXO);
-  stns_request(&c, "get?notfound", &r);
-  cr_assert_eq(stat(path, &st), -1);
-  free(r.data);
+  cached.data = NULL;
+  cr_assert_eq(stns_cache_get(&c, "get?example", &cached, &expires_at), 0);
 
   stns_request(&c, "get?example", &r);
+  cr_assert_eq(stns_cache_get(&c, "get?example", &cached, &expires_at), 1);
+  cr_assert_str_eq(cached.data, r.data);
   free(r.data);
-  cr_assert_eq(stat(path, &st), 0);
   sleep(2);
 
-  stns_request(&c, "get?notfound", &r);
-  cr_assert_eq(stat(path, &st), -1);
+  cr_assert(expires_at < time(NULL));
+  stns_request(&c, "get?example", &r);
+  cr_assert_eq(stns_cache_get(&c, "get?example", &cached, &expires_at), 1);
+  cr_assert(expires_at > time(NULL));
+  free(cached.data);
   free(r.data);
 }
 
@@ -196,17 +279,332 @@ Test(stns_request, http_request_with_header)
   free(http_headers);
 }
 
-Test(stns_request_available, ok)
+Test(stns_request_backoff, jitter)
 {
-  char expect_body[1024];
-  stns_conf_t c;
+  stns_conf_t c = test_conf();
+  long d;
+  int i;
+
+  for (i = 0; i < 100; i++) {
+    d = stns_request_backoff(&c, 0);
+    cr_assert(d >= 50 && d <= 100);
+    d = stns_request_backoff(&c, 2);
+    cr_assert(d >= 200 && d <= 400);
+    d = stns_request_backoff(&c, 10);
+    cr_assert(d >= 500 && d <= 1000);
+  }
+
+  c.request_backoff = 0;
+  cr_assert_eq(stns_request_backoff(&c, 3), 0);
+}
+
+Test(stns_request, deadline)
+{
+  stns_conf_t c = test_conf();
+  stns_response_t r;
+  struct timespec t0, t1;
+  long elapsed;
+
+  // nothing listens there, so every attempt fails at once and the retries
+  // are bounded by the deadline rather than by request_retry
+  c.api_endpoint     = "http://127.0.0.1:1";
+  c.request_retry    = 100;
+  c.request_deadline = 500;
+  clock_gettime(CLOCK_MONOTONIC, &t0);
+  cr_assert_eq(stns_request(&c, "users", &r), CURLE_COULDNT_CONNECT);
+  clock_gettime(CLOCK_MONOTONIC, &t1);
+  elapsed = (t1.tv_sec - t0.tv_sec) * 1000 + (t1.tv_nsec - t0.tv_nsec) / 1000000;
+  cr_assert(elapsed >= 100 && elapsed < 1000);
+  free(r.data);
+}
+
+static stns_conf_t stale_test_conf(char *cache_dir)
+{
+  stns_conf_t c = cache_test_conf(cache_dir);
+
+  c.api_endpoint  = "http://127.0.0.1:1";
+  c.cache         = 1;
+  c.cache_ttl     = 10;
+  c.request_retry = 0;
+  return c;
+}
+
+Test(stns_request, stale_if_error)
+{
+  stns_conf_t c = stale_test_conf("/tmp/stns_stale_if_error_test");
   stns_response_t r;
+  time_t expires_at;
 
-  c.request_locktime = 1;
-  stns_make_lockfile(STNS_LOCK_FILE);
-  cr_assert_eq(stns_request_available(STNS_LOCK_FILE, &c), 0);
-  sleep(3);
-  cr_assert_eq(stns_request_available(STNS_LOCK_FILE, &c), 1);
+  r.data = strdup("[{\"name\":\"test\"}]");
+  r.size = strlen(r.data);
+  stns_cache_put(&c, "users?name=test", &r, -5);
+  free(r.data);
+
+  cr_assert_eq(stns_request(&c, "users?name=test", &r), CURLE_COULDNT_CONNECT);
+  free(r.data);
+  // the failure is not cached as a negative entry
+  r.data = NULL;
+  cr_assert_eq(stns_cache_get(&c, "users?name=test", &r, &expires_at), 1);
+  cr_assert(r.size > 0);
+  free(r.data);
+
+  c.cache_stale_ttl = 60;
+  cr_assert_eq(stns_request(&c, "users?name=test", &r), CURLE_OK);
+  cr_assert_str_eq(r.data, "[{\"name\":\"test\"}]");
+  cr_assert_eq(r.stale, 1);
+  free(r.data);
+}
+
+Test(stns_request, cached_expiry)
+{
+  stns_conf_t c = stale_test_conf("/tmp/stns_cached_expiry_test");
+  stns_response_t r;
+  time_t expires_at;
+
+  r.data = strdup("[]");
+  r.size = 2;
+  stns_cache_put(&c, "users?name=test", &r, 5);
+  free(r.data);
+
+  // a cached body carries the expiry it was stored with, not a new cache_ttl
+  cr_assert_eq(stns_request(&c, "users?name=test", &r), CURLE_OK);
+  cr_assert_eq(r.stale, 0);
+  free(r.data);
+  r.data = NULL;
+  cr_assert_eq(stns_cache_get(&c, "users?name=test", &r, &expires_at), 1);
+  free(r.data);
+  cr_assert_eq(stns_request(&c, "users?name=test", &r), CURLE_OK);
+  cr_assert_eq(r.expires_at, expires_at);
+  free(r.data);
+}
+
+Test(stns_request, stale_while_revalidate)
+{
+  stns_conf_t c = stale_test_conf("/tmp/stns_stale_while_revalidate_test");
+  stns_response_t r;
+  int64_t lease;
+
+  c.cache_stale_ttl              = 60;
+  c.cache_stale_while_revalidate = 1;
+  r.data                         = strdup("[]");
+  r.size                         = 2;
+  stns_cache_put(&c, "users?name=test", &r, -5);
+  free(r.data);
+
+  // another process is refreshing the entry
+  cr_assert_eq(stns_state_claim_refresh(&c, "users?name=test", &lease), 1);
+  cr_assert_eq(stns_state_claim_refresh(&c, "users?name=test", &lease), 0);
+  cr_assert_eq(stns_request(&c, "users?name=test", &r), CURLE_OK);
+  cr_assert_eq(r.stale, 1);
+  free(r.data);
+}
+
+static int count_files(const char *dir)
+{
+  DIR *dp = opendir(dir);
+  struct dirent *ent;
+  char sub[MAXBUF * 2];
+  int n = 0;
+
+  while (dp != NULL && (ent = readdir(dp)) != NULL) {
+    if (ent->d_name[0] == '.')
+      continue;
+    snprintf(sub, sizeof(sub), "%s/%s", dir, ent->d_name);
+    n += ent->d_type == DT_DIR ? count_files(sub) : 1;
+  }
+  if (dp != NULL)
+    closedir(dp);
+  return n;
+}
+
+static void cache_file_name(stns_conf_t *c, const char *query, char *file, size_t len)
+{
+  uint64_t h = stns_hash64(query, strlen(query));
+  snprintf(file, len, "%s/%d/%02x/%016llx", c->cache_dir, geteuid(), (unsigned int)(h >> 56), (unsigned long long)h);
+}
+
+Test(stns_cache_file, put_and_get)
+{
+  stns_conf_t c = stale_test_conf("/tmp/stns_put_and_get_test");
+  stns_response_t r;
+  time_t stored_at;
+  char file[MAXBUF];
+  FILE *fp;
+
+  r.data = strdup("[{\"name\":\"test\"}]");
+  r.size = strlen(r.data);
+  stns_cache_file_put(&c, "users?name=test", &r);
+  free(r.data);
+
+  r.data = NULL;
+  cr_assert_eq(stns_cache_file_get(&c, "users?name=test", &r, &stored_at), 1);
+  cr_assert_str_eq(r.data, "[{\"name\":\"test\"}]");
+  cr_assert_eq(r.status_code, 200);
+  cr_assert(stored_at <= time(NULL));
+  free(r.data);
+
+  r.data = NULL;
+  r.size = 0;
+  stns_cache_file_put(&c, "users?name=nobody", &r);
+  cr_assert_eq(stns_cache_file_get(&c, "users?name=nobody", &r, &stored_at), 1);
+  cr_assert_eq(r.size, 0);
+  cr_assert_eq(r.status_code, STNS_HTTP_NOTFOUND);
+  free(r.data);
+
+  // a file whose header names another query is a miss
+  stns_cache_file_put(&c, "users?name=other", &r);
+  cache_file_name(&c, "users?name=other", file, sizeof(file));
+  fp = fopen(file, "w");
+  fprintf(fp, "users?name=collision\n[]");
+  fclose(fp);
+  r.data = NULL;
+  cr_assert_eq(stns_cache_file_get(&c, "users?name=other", &r, &stored_at), 0);
+}
+
+Test(stns_cache_file, migrate)
+{
+  stns_conf_t c = stale_test_conf("/tmp/stns_migrate_test");
+  struct utimbuf old = {0, 0};
+  stns_response_t r;
+  time_t stored_at;
+  char file[MAXBUF], legacy[MAXBUF], dir[MAXBUF];
+  int i;
+
+  snprintf(dir, sizeof(dir), "%s/%d", c.cache_dir, geteuid());
+  snprintf(legacy, sizeof(legacy), "%s/users%%3Fname%%3Dold", dir);
+  cache_file_name(&c, "users?name=old", file, sizeof(file));
+  unlink(file);
+  stns_export_file(dir, legacy, "[{\"name\":\"old\"}]");
+  old.actime = old.modtime = time(NULL) - 5;
+  utime(legacy, &old);
+
+  // a lookup does not look for the flat layout
+  r.data = NULL;
+  cr_assert_eq(stns_cache_file_get(&c, "users?name=old", &r, &stored_at), 0);
+  cr_assert_eq(access(legacy, F_OK), 0);
+
+  // the GC moves it into the sharded one, keeping its age
+  c.cache = 0;
+  for (i = 0; i < 20; i++)
+    stns_cache_files_gc(&c);
+  cr_assert_neq(access(legacy, F_OK), 0);
+  cr_assert_eq(stns_cache_file_get(&c, "users?name=old", &r, &stored_at), 1);
+  cr_assert_str_eq(r.data, "[{\"name\":\"old\"}]");
+  cr_assert_eq(stored_at, old.modtime);
+  free(r.data);
+}
+
+Test(stns_cache_file, atomic_replace)
+{
+  stns_conf_t c = stale_test_conf("/tmp/stns_atomic_replace_test");
+  stns_response_t a, b, r;
+  time_t stored_at;
+  pid_t pid;
+  int i, status;
+
+  a.size = 5000;
+  a.data = malloc(a.size + 1);
+  memset(a.data, 'a', a.size);
+  a.data[a.size] = '\0';
+  b.size         = 9000;
+  b.data         = malloc(b.size + 1);
+  memset(b.data, 'b', b.size);
+  b.data[b.size] = '\0';
+  stns_cache_file_put(&c, "users", &a);
+
+  if ((pid = fork()) == 0) {
+    for (i = 0; i < 2000; i++)
+      stns_cache_file_put(&c, "users", i % 2 ? &a : &b);
+    _exit(0);
+  }
+
+  // a reader sees one body or the other, whole, and never a partial one
+  r.data = NULL;
+  for (i = 0; i < 2000; i++) {
+    cr_assert_eq(stns_cache_file_get(&c, "users", &r, &stored_at), 1);
+    cr_assert(r.size == a.size || r.size == b.size);
+    cr_assert_eq(r.data[0], r.data[r.size - 1]);
+  }
+  waitpid(pid, &status, 0);
+  free(r.data);
+  free(a.data);
+  free(b.data);
+}
+
+Test(stns_cache_files_gc, batch)
+{
+  stns_conf_t c = stale_test_conf("/tmp/stns_gc_test");
+  struct utimbuf old = {0, 0};
+  stns_response_t r = {"[]", 2, 200, 0};
+  char dir[MAXBUF], query[MAXBUF], file[MAXBUF * 2];
+  int i;
+
+  snprintf(dir, sizeof(dir), "%s/%d", c.cache_dir, geteuid());
+  mkdir(dir, S_IRWXU);
+  old.actime = old.modtime = time(NULL) - c.cache_ttl - 10;
+  for (i = 0; i < 300; i++) {
+    snprintf(query, sizeof(query), "users?name=user%d", i);
+    if (i % 2 == 0) {
+      stns_cache_file_put(&c, query, &r);
+      cache_file_name(&c, query, file, sizeof(file));
+    } else {
+      snprintf(file, sizeof(file), "%s/users%%3Fname%%3Duser%d", dir, i);
+      stns_export_file(dir, file, "[]");
+    }
+    utime(file, &old);
+  }
+  stns_cache_file_put(&c, "users?name=fresh", &r);
+
+  // one batch per interval for the whole euid
+  stns_cache_files_gc(&c);
+  i = count_files(dir);
+  cr_assert(i < 301);
+  stns_cache_files_gc(&c);
+  cr_assert_eq(count_files(dir), i);
+
+  // without the shared state every call runs a batch
+  c.cache = 0;
+  for (i = 0; i < 20; i++)
+    stns_cache_files_gc(&c);
+  cr_assert_eq(count_files(dir), 1);
+}
+
+Test(stns_cache_files_gc, temp_files)
+{
+  stns_conf_t c = stale_test_conf("/tmp/stns_gc_temp_test");
+  struct utimbuf old = {0, 0};
+  stns_response_t r = {"[]", 2, 200, 0};
+  char dir[MAXBUF], file[MAXBUF * 2], path[MAXBUF * 3];
+  const char *names[] = {".cache.a1B2c3", ".filter.users.a1B2c3", ".state.a1B2c3", ".filter.groups", ".tls_sessions"};
+  int i;
+
+  snprintf(dir, sizeof(dir), "%s/%d", c.cache_dir, geteuid());
+  mkdir(dir, S_IRWXU);
+  old.actime = old.modtime = time(NULL) - STNS_CACHE_TEMP_TTL - 1;
+  for (i = 0; i < 5; i++) {
+    snprintf(path, sizeof(path), "%s/%s", dir, names[i]);
+    stns_export_file(dir, path, "[]");
+    // the state file stays as fresh as a write in progress
+    if (i != 2)
+      utime(path, &old);
+  }
+  stns_cache_file_put(&c, "users?name=test", &r);
+  cache_file_name(&c, "users?name=test", file, sizeof(file));
+  snprintf(path, sizeof(path), "%s.a1B2c3", file);
+  stns_export_file(dir, path, "[]");
+  utime(path, &old);
+
+  // the temporary files left by a writer that died go, and nothing else
+  c.cache = 0;
+  for (i = 0; i < 20; i++)
+    stns_cache_files_gc(&c);
+  snprintf(path, sizeof(path), "%s.a1B2c3", file);
+  cr_assert_neq(access(path, F_OK), 0);
+  cr_assert_eq(access(file, F_OK), 0);
+  for (i = 0; i < 5; i++) {
+    snprintf(path, sizeof(path), "%s/%s", dir, names[i]);
+    cr_assert_eq(access(path, F_OK), (i < 2 ? -1 : 0));
+  }
 }
 
 Test(stns_exec_cmd, ok)
@@ -238,6 +636,26 @@ Test(query_available, ok)
   cr_assert_eq(stns_group_lowest_query_available(2), 0);
 }
 
+Test(query_available, range)
+{
+  set_user_highest_id(20000);
+  set_user_lowest_id(1000);
+  cr_assert_eq(get_user_highest_id(), 20000);
+  cr_assert_eq(get_user_lowest_id(), 1000);
+  cr_assert_eq(stns_user_id_query_available(NULL, 0), 0);
+  cr_assert_eq(stns_user_id_query_available(NULL, 999), 0);
+  cr_assert_eq(stns_user_id_query_available(NULL, 1000), 1);
+  cr_assert_eq(stns_user_id_query_available(NULL, 20000), 1);
+  cr_assert_eq(stns_user_id_query_available(NULL, 20001), 0);
+
+  // updating one end keeps the other
+  set_user_highest_id(0);
+  cr_assert_eq(get_user_lowest_id(), 1000);
+  cr_assert_eq(stns_user_id_query_available(NULL, 20001), 1);
+  set_user_lowest_id(0);
+  cr_assert_eq(stns_user_id_query_available(NULL, 0), 1);
+}
+
 Test(stns_request, http_request_with_cached)
 {
   char expect_body[1024];
@@ -262,3 +680,38 @@ Test(stns_request, http_request_notfound_with_cached)
   cr_assert_eq(stns_request(&c, "status/404", &r), CURLE_HTTP_RETURNED_ERROR);
   free(r.data);
 }
+
+Test(stns_http_connection_stats, reuse)
+{
+  unsigned long before_new, before_reused, after_new, after_reused;
+  stns_conf_t c = test_conf();
+  stns_response_t r;
+
+  stns_http_connection_stats(&before_new, &before_reused);
+  stns_request(&c, "user-agent", &r);
+  free(r.data);
+  stns_request(&c, "user-agent", &r);
+  free(r.data);
+  stns_http_connection_stats(&after_new, &after_reused);
+
+  cr_assert_eq(after_new - before_new, 1);
+  cr_assert_eq(after_reused - before_reused, 1);
+}
+
+Test(stns_request, tls_session_cache)
+{
+  struct stat st;
+  stns_conf_t c = test_conf();
+  stns_response_t r;
+  char path[MAXBUF];
+  snprintf(path, sizeof(path), "/var/cache/stns/%d/%s", geteuid(), STNS_TLS_SESSION_FILE);
+
+  unlink(path);
+  c.tls_session_cache = 1;
+  mkdir("/var/cache/stns/", S_ISVTX | S_IRWXU | S_IRWXG | S_IRWXO);
+  stns_request(&c, "user-agent", &r);
+  free(r.data);
+
+  cr_assert_eq(stat(path, &st), 0);
+  cr_assert_eq(st.st_mode & 0777, 0600);
+}
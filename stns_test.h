@@ -9,4 +9,5 @@
 #include "stns_group.h"
 
 extern void readfile(char *file, char **result);
+extern stns_conf_t cache_test_conf(const char *dir);
 #endif /* STNS_TEST_H */
@@ -0,0 +1,204 @@
+// Compare the streaming decoder used by the lookups against a parson DOM walk,
+// on the fixtures in test/ and on a generated list of users, and the import
+// of a cached enumeration against the line by line read it replaced.
+#include <stdio.h>
+#include <time.h>
+#include "../stns.h"
+#include "../stns_passwd.h"
+#include "../stns_group.h"
+
+#define BENCH_USERS 10000
+// about 10MB of users
+#define BENCH_IMPORT_USERS 60000
+#define BENCH_IMPORT_FILE "/tmp/stns_bench_import"
+
+static char *readall(const char *file)
+{
+  FILE *fp = fopen(file, "r");
+  char *data;
+  long size;
+
+  if (fp == NULL)
+    return NULL;
+  fseek(fp, 0, SEEK_END);
+  size = ftell(fp);
+  rewind(fp);
+  data = (char *)malloc(size + 1);
+  if (fread(data, 1, size, fp) != (size_t)size) {
+    fclose(fp);
+    free(data);
+    return NULL;
+  }
+  data[size] = '\0';
+  fclose(fp);
+  return data;
+}
+
+static char *generate_users(int n)
+{
+  size_t size = 64 + (size_t)n * 256;
+  char *data  = (char *)malloc(size);
+  size_t len  = 0;
+  int i;
+
+  len += snprintf(data + len, size - len, "[");
+  for (i = 0; i < n; i++) {
+    len += snprintf(data + len, size - len,
+                    "%s{\"id\":%d,\"name\":\"user%d\",\"password\":\"\",\"group_id\":%d,\"directory\":\"/home/user%d\","
+                    "\"shell\":\"/bin/bash\",\"gecos\":\"\",\"keys\":[\"ssh-ed25519 AAAA user%d\"],\"link_users\":null}",
+                    i == 0 ? "" : ",", i + 1, i, i + 1, i, i);
+  }
+  snprintf(data + len, size - len, "]");
+  return data;
+}
+
+static double now(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// The lookup as it was done before the streaming decoder: build the whole
+// document, then walk it.
+static int parson_lookup(char *data, const char *key)
+{
+  JSON_Value *root = json_parse_string(data);
+  JSON_Array *array;
+  size_t i;
+  int found = 0;
+
+  if (root == NULL)
+    return 0;
+  array = json_value_get_array(root);
+  for (i = 0; i < json_array_get_count(array); i++) {
+    JSON_Object *leaf = json_array_get_object(array, i);
+    const char *name  = json_object_get_string(leaf, "name");
+    if (name != NULL && strcmp(name, key) == 0) {
+      found = 1;
+      break;
+    }
+  }
+  json_value_free(root);
+  return found;
+}
+
+static void bench(const char *label, char *data, const char *key, int group, int iterations)
+{
+  char buf[MAXBUF * 4];
+  struct passwd pwd;
+  struct group grd;
+  stns_conf_t c;
+  double start, parson, stream;
+  int i;
+
+  c.uid_shift = 0;
+  c.gid_shift = 0;
+
+  start = now();
+  for (i = 0; i < iterations; i++)
+    parson_lookup(data, key);
+  parson = (now() - start) / iterations;
+
+  start = now();
+  for (i = 0; i < iterations; i++) {
+    if (group)
+      ensure_group_by_name(data, &c, key, &grd, buf, sizeof(buf), NULL);
+    else
+      ensure_passwd_by_name(data, &c, key, &pwd, buf, sizeof(buf), NULL);
+  }
+  stream = (now() - start) / iterations;
+
+  printf("%-24s parson %10.0f ns/op  stream %10.0f ns/op  x%.1f\n", label, parson * 1e9, stream * 1e9, parson / stream);
+}
+
+// The import as it was done before: 1KB at a time with fgets, growing the
+// body with realloc and strcpy, then a strlen over all of it.
+static int fgets_import(char *file, stns_response_t *res)
+{
+  FILE *fp = fopen(file, "r");
+  char buf[MAXBUF];
+  int total_len = 0;
+  int len       = 0;
+
+  if (!fp)
+    return 0;
+  while (fgets(buf, sizeof(buf), fp) != NULL) {
+    len = strlen(buf);
+    if (!res->data) {
+      res->data = (char *)malloc(len + 1);
+    } else {
+      res->data = (char *)realloc(res->data, total_len + len + 1);
+    }
+    strcpy(res->data + total_len, buf);
+    total_len += len;
+  }
+  fclose(fp);
+  res->size = strlen(res->data);
+  return 1;
+}
+
+static void bench_import(int iterations)
+{
+  char *data = generate_users(BENCH_IMPORT_USERS);
+  stns_response_t r;
+  double start, before, after;
+  size_t size = strlen(data);
+  int i, j;
+
+  // one line, as the API sends it, and one line per entry
+  for (i = 0; i < 2; i++) {
+    if (i == 1) {
+      char *p = data;
+      while ((p = strstr(p, "},{")) != NULL)
+        p[1] = '\n';
+    }
+    unlink(BENCH_IMPORT_FILE);
+    stns_export_file("/tmp", BENCH_IMPORT_FILE, data);
+
+    start = now();
+    for (j = 0; j < iterations; j++) {
+      r.data = NULL;
+      fgets_import(BENCH_IMPORT_FILE, &r);
+      free(r.data);
+    }
+    before = (now() - start) / iterations;
+
+    start = now();
+    for (j = 0; j < iterations; j++) {
+      r.data = NULL;
+      stns_import_file(BENCH_IMPORT_FILE, &r);
+      free(r.data);
+    }
+    after = (now() - start) / iterations;
+
+    printf("import %.1fMB, %-11s fgets %10.0f us/op  read   %10.0f us/op  x%.1f\n", size / 1e6,
+           i == 0 ? "one line" : "entry lines", before * 1e6, after * 1e6, before / after);
+  }
+  unlink(BENCH_IMPORT_FILE);
+  free(data);
+}
+
+int main(void)
+{
+  char *users  = readall("test/example1.json");
+  char *groups = readall("test/example2.json");
+  char *large  = generate_users(BENCH_USERS);
+  char last[32];
+
+  if (users == NULL || groups == NULL) {
+    fprintf(stderr, "run from the repository root\n");
+    return 1;
+  }
+  snprintf(last, sizeof(last), "user%d", BENCH_USERS - 1);
+
+  bench("example1.json user2", users, "user2", 0, 200000);
+  bench("example2.json group2", groups, "group2", 1, 200000);
+  bench("10000 users, last", large, last, 0, 50);
+  bench_import(20);
+
+  free(users);
+  free(groups);
+  free(large);
+  return 0;
+}